@@ -4,6 +4,7 @@
 #include <cstddef>
 #include <deque>
 #include <memory>
+#include "delay_delete_arena.hpp"
 
 namespace utils {
 
@@ -61,6 +62,12 @@ class DelayDeleteAllocator {
     return;
   }
 
+  //批量放入回收列表
+  template <class Iter>
+  void destroy_batch(Iter first, Iter last) {
+    dirty_list_.insert(dirty_list_.end(), first, last);
+  }
+
   size_type max_size() const {
     return size_t(-1)/sizeof(T);
   };
@@ -72,15 +79,27 @@ class DelayDeleteAllocator {
   }
   void garbage_collect() {
     while(!dirty_list_.empty()) {
-      delete dirty_list_.front();
+      pointer p = dirty_list_.front();
+      if (arena_ && arena_->contains(p)) {
+        //compact后放在arena中的对象，析构后归还arena
+        p->~T();
+        arena_->release(p);
+      } else {
+        delete p;
+      }
       dirty_list_.pop_front();
     }
   }
 
+  void set_arena(DelayDeleteArenaSet* arena) {
+    arena_ = arena;
+  }
+
  private:
   DelayDeleteAllocator(const DelayDeleteAllocator&) = delete;
   DelayDeleteAllocator& operator = (const DelayDeleteAllocator&) = delete;
   std::deque<pointer> dirty_list_;     //未destroy对象列表
+  DelayDeleteArenaSet* arena_ {nullptr};
 }; 
 
 }
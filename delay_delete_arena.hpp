@@ -0,0 +1,85 @@
+#ifndef UTILS_DELAY_DELETE_ARENA_HPP_
+#define UTILS_DELAY_DELETE_ARENA_HPP_
+
+#include <cstddef>
+#include <iostream>
+#include <map>
+#include <new>
+#include "delay_delete_huge_page.hpp"
+
+namespace utils {
+
+//连续内存块集合，compact时把存活的节点和value按桶顺序放到同一块内存中。
+//每块记录块内存活对象数，对象全部释放后整块释放。
+//只在写线程中使用。
+class DelayDeleteArenaSet {
+ public:
+  DelayDeleteArenaSet() {}
+  ~DelayDeleteArenaSet() {
+    for (std::map<char*, Chunk>::iterator it = chunks_.begin(); it != chunks_.end(); ++it) {
+      huge_page_free(it->first);
+    }
+  }
+
+  //分配bytes大小的块，块内将放n_object个对象
+  void* allocate_chunk(size_t bytes, size_t n_object) {
+    char* p = static_cast<char*>(huge_page_alloc(bytes));
+    if (!p) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " arena no memory " << bytes << std::endl;
+      return nullptr;
+    }
+    Chunk& c = chunks_[p];
+    c.size = bytes;
+    c.live = n_object;
+    return p;
+  }
+
+  //p是否在某个块内
+  bool contains(const void* p) {
+    return find_chunk(p) != chunks_.end();
+  }
+
+  //块内对象已析构，存活数减一，为0时释放整块
+  void release(const void* p) {
+    std::map<char*, Chunk>::iterator it = find_chunk(p);
+    if (it == chunks_.end()) {
+      return;
+    }
+    if (0 == --it->second.live) {
+      huge_page_free(it->first);
+      chunks_.erase(it);
+    }
+  }
+
+  size_t chunk_count() const {
+    return chunks_.size();
+  }
+
+ private:
+  struct Chunk {
+    size_t size;
+    size_t live;
+  };
+
+  DelayDeleteArenaSet(const DelayDeleteArenaSet&) = delete;
+  DelayDeleteArenaSet& operator = (const DelayDeleteArenaSet&) = delete;
+
+  std::map<char*, Chunk>::iterator find_chunk(const void* p) {
+    char* addr = static_cast<char*>(const_cast<void*>(p));
+    std::map<char*, Chunk>::iterator it = chunks_.upper_bound(addr);
+    if (it == chunks_.begin()) {
+      return chunks_.end();
+    }
+    --it;
+    if (addr >= it->first + it->second.size) {
+      return chunks_.end();
+    }
+    return it;
+  }
+
+  std::map<char*, Chunk> chunks_;
+};
+
+}
+
+#endif
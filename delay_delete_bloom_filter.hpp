@@ -0,0 +1,86 @@
+#ifndef UTILS_DELAY_DELETE_BLOOM_FILTER_HPP_
+#define UTILS_DELAY_DELETE_BLOOM_FILTER_HPP_
+
+#include <memory.h>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include "delay_delete_hash.hpp"
+#include "delay_delete_huge_page.hpp"
+
+namespace utils {
+
+//按cache line分块的bloom filter。
+//一个key的8个bit落在同一个64字节块内，每个uint64_t各一个bit，
+//查询只访问一条cache line。只支持添加，删除后的残留bit在rebuild时清除。
+//一个写线程add，多个读线程may_contain。
+class BlockedBloomFilter {
+ public:
+  static const size_t kWordsPerBlock = 8;
+  static const size_t kBitsPerBlock = kWordsPerBlock * 64;
+
+  BlockedBloomFilter() {}
+  ~BlockedBloomFilter() {
+    huge_page_free(blocks_);
+  }
+
+  //n_item 预期元素个数，bits_per_item 每个元素占用的bit数
+  int init(size_t n_item, size_t bits_per_item) {
+    size_t nblock = (n_item * bits_per_item + kBitsPerBlock - 1) / kBitsPerBlock;
+    if (0 == nblock) {
+      nblock = 1;
+    }
+    //huge_page_alloc返回64字节对齐且已清零的内存
+    void* p = huge_page_alloc(nblock * kWordsPerBlock * sizeof(uint64_t));
+    if (!p) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " bloom filter no memory " << nblock << std::endl;
+      return -1;
+    }
+    huge_page_free(blocks_);
+    blocks_ = static_cast<uint64_t*>(p);
+    nblock_ = nblock;
+    return 0;
+  }
+
+  int init_copy(const BlockedBloomFilter& other) {
+    if (init(other.nblock_ * kBitsPerBlock, 1) != 0) {
+      return -1;
+    }
+    memcpy(blocks_, other.blocks_, nblock_ * kWordsPerBlock * sizeof(uint64_t));
+    return 0;
+  }
+
+  void add(size_t hash_code) {
+    uint64_t x = mix_integer_hash(hash_code);
+    uint64_t* block = blocks_ + (x % nblock_) * kWordsPerBlock;
+    uint64_t y = mix_integer_hash(x);
+    for (size_t i = 0; i < kWordsPerBlock; ++i) {
+      block[i] |= 1ull << ((y >> (6 * i)) & 63);
+    }
+  }
+
+  bool may_contain(size_t hash_code) const {
+    uint64_t x = mix_integer_hash(hash_code);
+    const uint64_t* block = blocks_ + (x % nblock_) * kWordsPerBlock;
+    uint64_t y = mix_integer_hash(x);
+    uint64_t miss = 0;
+    for (size_t i = 0; i < kWordsPerBlock; ++i) {
+      miss |= ~block[i] & (1ull << ((y >> (6 * i)) & 63));
+    }
+    return 0 == miss;
+  }
+
+  size_t block_count() const {
+    return nblock_;
+  }
+
+ private:
+  BlockedBloomFilter(const BlockedBloomFilter&) = delete;
+  BlockedBloomFilter& operator = (const BlockedBloomFilter&) = delete;
+  uint64_t* blocks_ {nullptr};
+  size_t nblock_ {0};
+};
+
+}
+
+#endif
@@ -0,0 +1,245 @@
+#ifndef UTILS_DELAY_DELETE_CORO_LOOKUP_HPP_
+#define UTILS_DELAY_DELETE_CORO_LOOKUP_HPP_
+
+//基于C++20协程的交错查找，低于C++20时本文件为空
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <utility>
+#include <vector>
+
+namespace utils {
+
+//一个线程上交错执行多条查找链。
+//查找链写成返回DelayDeleteLookupTask的协程，每次co_await find/equal_range时
+//先预取桶并挂起，轮到它时再预取链头的value并挂起，第三次轮到时才真正查找。
+//两次挂起之间调度器执行其它查找链，多条链的桶和节点访存重叠。
+//例：
+//  DelayDeleteLookupTask<size_t> count_items(DelayDeleteLookupScheduler& s, uint64_t uid) {
+//    auto user = co_await s.find(users, uid);
+//    if (!user) co_return 0;
+//    auto range = co_await s.equal_range(user_items, user->second);
+//    ...
+//  }
+//  std::vector<DelayDeleteLookupTask<size_t> > tasks;
+//  for (uint64_t uid : uids) tasks.push_back(count_items(s, uid));
+//  s.run(tasks);
+//与find相同，只能在读线程中使用，查找期间map中的对象由延迟删除保证有效。
+class DelayDeleteLookupScheduler;
+
+template <class T>
+class DelayDeleteLookupTask {
+ public:
+  struct promise_type;
+  typedef std::coroutine_handle<promise_type> handle_type;
+
+  //task结束时回到co_await它的协程，顶层task通知调度器
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+    template <class P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept;
+    void await_resume() noexcept {}
+  };
+
+  struct promise_type {
+    T value {};
+    std::coroutine_handle<> continuation;
+    DelayDeleteLookupScheduler* scheduler {nullptr};
+
+    DelayDeleteLookupTask get_return_object() {
+      return DelayDeleteLookupTask(handle_type::from_promise(*this));
+    }
+    //创建后挂起，由spawn或者co_await开始执行
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void return_value(T v) { value = std::move(v); }
+    void unhandled_exception() { std::terminate(); }
+  };
+
+  DelayDeleteLookupTask() {}
+  DelayDeleteLookupTask(DelayDeleteLookupTask&& other) : handle_(other.handle_) {
+    other.handle_ = nullptr;
+  }
+  DelayDeleteLookupTask& operator = (DelayDeleteLookupTask&& other) {
+    if (this != &other) {
+      if (handle_) {
+        handle_.destroy();
+      }
+      handle_ = other.handle_;
+      other.handle_ = nullptr;
+    }
+    return *this;
+  }
+  ~DelayDeleteLookupTask() {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  bool done() const { return !handle_ || handle_.done(); }
+  //task结束后取结果
+  T& result() { return handle_.promise().value; }
+
+  //在另一个task中co_await，直接切换到这个task执行
+  bool await_ready() const noexcept { return done(); }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept {
+    handle_.promise().continuation = h;
+    return handle_;
+  }
+  T await_resume() { return std::move(handle_.promise().value); }
+
+ private:
+  friend class DelayDeleteLookupScheduler;
+  explicit DelayDeleteLookupTask(handle_type h) : handle_(h) {}
+  DelayDeleteLookupTask(const DelayDeleteLookupTask&) = delete;
+  DelayDeleteLookupTask& operator = (const DelayDeleteLookupTask&) = delete;
+
+  handle_type handle_ {nullptr};
+};
+
+class DelayDeleteLookupScheduler {
+ public:
+  //co_await得到Map::iterator
+  template <class Map, class K>
+  struct FindAwaiter {
+    DelayDeleteLookupScheduler* scheduler;
+    Map* map;
+    const K* key;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+      map->prefetch(*key);
+      scheduler->schedule(h, &FindAwaiter::prefetch_chain, this);
+    }
+    typename Map::iterator await_resume() { return map->find(*key); }
+
+    static void prefetch_chain(void* arg) {
+      FindAwaiter* self = static_cast<FindAwaiter*>(arg);
+      self->map->prefetch_chain(*self->key);
+    }
+  };
+
+  //co_await得到std::pair<Map::iterator, Map::iterator>
+  template <class Map, class K>
+  struct EqualRangeAwaiter {
+    DelayDeleteLookupScheduler* scheduler;
+    Map* map;
+    const K* key;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+      map->prefetch(*key);
+      scheduler->schedule(h, &EqualRangeAwaiter::prefetch_chain, this);
+    }
+    std::pair<typename Map::iterator, typename Map::iterator> await_resume() {
+      return map->equal_range(*key);
+    }
+
+    static void prefetch_chain(void* arg) {
+      EqualRangeAwaiter* self = static_cast<EqualRangeAwaiter*>(arg);
+      self->map->prefetch_chain(*self->key);
+    }
+  };
+
+  //key在co_await结束前必须有效
+  template <class Map, class K>
+  FindAwaiter<Map, K> find(Map& map, const K& key) {
+    return FindAwaiter<Map, K>{this, &map, &key};
+  }
+  template <class Map, class K>
+  EqualRangeAwaiter<Map, K> equal_range(Map& map, const K& key) {
+    return EqualRangeAwaiter<Map, K>{this, &map, &key};
+  }
+
+  //开始执行一个顶层task
+  template <class T>
+  void spawn(DelayDeleteLookupTask<T>& task) {
+    if (task.done()) {
+      return;
+    }
+    task.handle_.promise().scheduler = this;
+    ++active_;
+    ready_.push_back(Entry{task.handle_, nullptr, nullptr});
+  }
+
+  //执行到所有已spawn的task结束
+  void run() {
+    while (!ready_.empty()) {
+      step();
+    }
+  }
+
+  //依次执行tasks，同时最多window个task交错执行。
+  //window过大时各条链预取的数据会互相挤出cache，为0时按1处理
+  template <class T>
+  void run(std::vector<DelayDeleteLookupTask<T> >& tasks, size_t window = 16) {
+    if (0 == window) {
+      window = 1;
+    }
+    size_t next = 0;
+    while (true) {
+      while (active_ < window && next < tasks.size()) {
+        spawn(tasks[next++]);
+      }
+      if (ready_.empty()) {
+        break;
+      }
+      step();
+    }
+  }
+
+  //协程挂起后放入队列，轮到时先执行fn(arg)，再排到队尾等待恢复
+  void schedule(std::coroutine_handle<> h, void (*fn)(void*) = nullptr, void* arg = nullptr) {
+    ready_.push_back(Entry{h, fn, arg});
+  }
+
+ private:
+  template <class T>
+  friend class DelayDeleteLookupTask;
+
+  struct Entry {
+    std::coroutine_handle<> handle;
+    void (*fn)(void*);
+    void* arg;
+  };
+
+  void step() {
+    Entry e = ready_.front();
+    ready_.pop_front();
+    if (e.fn) {
+      e.fn(e.arg);
+      ready_.push_back(Entry{e.handle, nullptr, nullptr});
+    } else {
+      e.handle.resume();
+    }
+  }
+
+  void finish() {
+    --active_;
+  }
+
+  std::deque<Entry> ready_;
+  size_t active_ {0};     // 已spawn还没结束的顶层task数
+};
+
+template <class T>
+template <class P>
+std::coroutine_handle<> DelayDeleteLookupTask<T>::FinalAwaiter::await_suspend(std::coroutine_handle<P> h) noexcept {
+  promise_type& promise = h.promise();
+  if (promise.continuation) {
+    return promise.continuation;
+  }
+  if (promise.scheduler) {
+    promise.scheduler->finish();
+  }
+  return std::noop_coroutine();
+}
+
+}
+
+#endif
+
+#endif
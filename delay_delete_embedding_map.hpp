@@ -0,0 +1,192 @@
+#ifndef UTILS_DELAY_DELETE_EMBEDDING_MAP_HPP_
+#define UTILS_DELAY_DELETE_EMBEDDING_MAP_HPP_
+
+#include <memory.h>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <utility>
+#include <vector>
+#include "delay_delete_allocator.hpp"
+#include "delay_delete_hash.hpp"
+#include "delay_delete_huge_page.hpp"
+#include "delay_delete_table.hpp"
+
+namespace utils {
+
+//value为定长float向量(embedding)的map。
+//向量按行存放在64字节对齐的连续slab中，hash表中只存行号。
+//更新时写入新行，再替换节点发布，旧行号在garbage_collect时回收，
+//读线程看到的行在下次garbage_collect之前不会被改写。
+//slab按块分配，块表预先分配好，扩容时已有的行不移动。
+template <class Key,
+          class Equal = DelayDeleteEqual<Key>,
+          class Hash = DelayDeleteHash<Key> >
+class DelayDeleteEmbeddingMap {
+ private:
+  typedef std::pair<const Key, uint32_t> RowRef;
+  typedef DelayDeleteHashtable<Key, RowRef, DelayDeleteAllocator<RowRef>,
+            std::_Select1st<RowRef>, Equal, Hash> HashTable;
+  static const uint32_t kChunkShift = 12;                 // 每块4096行
+  static const uint32_t kRowsPerChunk = 1u << kChunkShift;
+  static const uint32_t kMaxChunk = 1u << 16;             // 最多2^28行
+  static const size_t kGatherGroup = 16;                  // gather每组预取的key数
+
+ public:
+  typedef Key key_type;
+  typedef typename HashTable::size_type size_type;
+
+  DelayDeleteEmbeddingMap() {}
+  ~DelayDeleteEmbeddingMap() {
+    if (chunks_) {
+      for (uint32_t i = 0; i < kMaxChunk && chunks_[i]; ++i) {
+        huge_page_free(chunks_[i]);
+      }
+      delete [] chunks_;
+    }
+  }
+
+  //n 预期元素个数，dim 向量维度
+  int init(size_type n, size_type dim) {
+    if (0 == dim || chunks_) {
+      return -1;
+    }
+    dim_ = dim;
+    //每行补齐到64字节
+    row_stride_ = (dim * sizeof(float) + 63) / 64 * 64 / sizeof(float);
+    chunks_ = new (std::nothrow) float* [kMaxChunk];
+    if (!chunks_) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " init no memory" << std::endl;
+      return -1;
+    }
+    memset(chunks_, 0, sizeof(float*) * kMaxChunk);
+    return ht_.init(n);
+  }
+
+  size_type dim() const { return dim_; }
+  size_type size() const { return ht_.size(); }
+  size_type bucket_count() { return ht_.bucket_count(); }
+
+  //写接口，只能在写线程调用。写入新行后替换节点，key已存在时旧行延迟回收。
+  //init之前调用返回-1
+  int insert(const Key& key, const float* row, bool is_resize = true) {
+    if (!chunks_) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " insert before init" << std::endl;
+      return -1;
+    }
+    uint32_t idx = allocate_row();
+    if (kNoRow == idx) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " no row for insert" << std::endl;
+      return -1;
+    }
+    memcpy(row_ptr(idx), row, dim_ * sizeof(float));
+    const RowRef* old = ht_.replace_unique(RowRef(key, idx), is_resize);
+    if (old) {
+      pending_rows_.push_back(old->second);
+    }
+    return 0;
+  }
+
+  void erase(const Key& key) {
+    if (!chunks_) {
+      return;
+    }
+    typename HashTable::iterator it = ht_.find(key);
+    if (!it) {
+      return;
+    }
+    pending_rows_.push_back(it->second);
+    ht_.erase(key);
+  }
+
+  void garbage_collect() {
+    ht_.garbage_collect();
+    free_rows_.insert(free_rows_.end(), pending_rows_.begin(), pending_rows_.end());
+    pending_rows_.clear();
+  }
+
+  //读接口，返回的行在下次garbage_collect前有效
+  const float* find(const Key& key) {
+    typename HashTable::iterator it = ht_.find(key);
+    return it ? row_ptr(it->second) : nullptr;
+  }
+
+  //批量取n个key的向量，写到out[i * dim]，不存在的key填0。
+  //每组kGatherGroup个key先预取桶，查到行号后预取行，最后再拷贝，
+  //多个key的访存重叠。行64字节对齐，memcpy按向量指令拷贝。
+  //found不为空时记录每个key是否存在。返回找到的key数
+  size_type gather(const Key* keys, size_type n, float* out, bool* found = nullptr) {
+    const float* rows[kGatherGroup];
+    size_type cnt = 0;
+    for (size_type begin = 0; begin < n; begin += kGatherGroup) {
+      size_type end = begin + kGatherGroup < n ? begin + kGatherGroup : n;
+      for (size_type i = begin; i < end; ++i) {
+        ht_.prefetch(keys[i]);
+      }
+      for (size_type i = begin; i < end; ++i) {
+        const float* r = find(keys[i]);
+        if (r) {
+          for (size_type off = 0; off < dim_ * sizeof(float); off += 64) {
+            __builtin_prefetch(reinterpret_cast<const char*>(r) + off);
+          }
+        }
+        rows[i - begin] = r;
+      }
+      for (size_type i = begin; i < end; ++i) {
+        const float* r = rows[i - begin];
+        if (r) {
+          memcpy(out + i * dim_, r, dim_ * sizeof(float));
+          ++cnt;
+        } else {
+          memset(out + i * dim_, 0, dim_ * sizeof(float));
+        }
+        if (found) {
+          found[i] = nullptr != r;
+        }
+      }
+    }
+    return cnt;
+  }
+
+ private:
+  static const uint32_t kNoRow = (uint32_t)-1;
+
+  DelayDeleteEmbeddingMap(const DelayDeleteEmbeddingMap&) = delete;
+  DelayDeleteEmbeddingMap& operator = (const DelayDeleteEmbeddingMap&) = delete;
+
+  float* row_ptr(uint32_t idx) const {
+    return chunks_[idx >> kChunkShift] + (size_t)(idx & (kRowsPerChunk - 1)) * row_stride_;
+  }
+
+  uint32_t allocate_row() {
+    if (!free_rows_.empty()) {
+      uint32_t idx = free_rows_.back();
+      free_rows_.pop_back();
+      return idx;
+    }
+    uint32_t chunk = next_row_ >> kChunkShift;
+    if (chunk >= kMaxChunk) {
+      return kNoRow;
+    }
+    if (!chunks_[chunk]) {
+      float* p = static_cast<float*>(huge_page_alloc(sizeof(float) * row_stride_ * kRowsPerChunk));
+      if (!p) {
+        return kNoRow;
+      }
+      chunks_[chunk] = p;
+    }
+    return next_row_++;
+  }
+
+  HashTable ht_;
+  size_type dim_ {0};
+  size_type row_stride_ {0};          // 每行float个数，补齐到64字节
+  float** chunks_ {nullptr};          // 块表，kMaxChunk项
+  uint32_t next_row_ {0};
+  std::vector<uint32_t> free_rows_;    // 可以复用的行
+  std::vector<uint32_t> pending_rows_; // 等待garbage_collect的行
+};
+
+}
+
+#endif
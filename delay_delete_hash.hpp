@@ -0,0 +1,167 @@
+#ifndef UTILS_DELAY_DELETE_HASH_HPP_
+#define UTILS_DELAY_DELETE_HASH_HPP_
+
+#include <memory.h>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <string>
+#include <type_traits>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+namespace utils {
+
+//murmur3 fmix64，64位上的双射，打散连续的整型id
+inline uint64_t mix_integer_hash(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdull;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ull;
+  k ^= k >> 33;
+  return k;
+}
+
+//进程启动时随机生成的hash种子，防止构造冲突key攻击
+inline uint64_t default_hash_seed() {
+  static const uint64_t seed = (uint64_t(std::random_device()()) << 32) ^ std::random_device()();
+  return seed;
+}
+
+inline uint64_t wy_mum(uint64_t a, uint64_t b) {
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+inline uint64_t wy_read8(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+inline uint64_t wy_read4(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+//wyhash风格的字节串hash，每次处理48字节，三路64位乘法并行
+inline uint64_t hash_bytes(const void* data, size_t len, uint64_t seed) {
+  static const uint64_t s0 = 0xa0761d6478bd642full;
+  static const uint64_t s1 = 0xe7037ed1a0b428dbull;
+  static const uint64_t s2 = 0x8ebc6af09c88c6e3ull;
+  static const uint64_t s3 = 0x589965cc75374cc3ull;
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  seed ^= wy_mum(seed ^ s0, s1);
+  uint64_t a = 0;
+  uint64_t b = 0;
+  if (len <= 16) {
+    if (len >= 4) {
+      a = (wy_read4(p) << 32) | wy_read4(p + ((len >> 3) << 2));
+      b = (wy_read4(p + len - 4) << 32) | wy_read4(p + len - 4 - ((len >> 3) << 2));
+    } else if (len > 0) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+    }
+  } else {
+    size_t i = len;
+    if (i > 48) {
+      uint64_t see1 = seed;
+      uint64_t see2 = seed;
+      do {
+        seed = wy_mum(wy_read8(p) ^ s1, wy_read8(p + 8) ^ seed);
+        see1 = wy_mum(wy_read8(p + 16) ^ s2, wy_read8(p + 24) ^ see1);
+        see2 = wy_mum(wy_read8(p + 32) ^ s3, wy_read8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    while (i > 16) {
+      seed = wy_mum(wy_read8(p) ^ s1, wy_read8(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    a = wy_read8(p + i - 16);
+    b = wy_read8(p + i - 8);
+  }
+  __uint128_t r = (__uint128_t)(a ^ s1) * (b ^ seed);
+  return wy_mum((uint64_t)r ^ s0 ^ len, (uint64_t)(r >> 64) ^ s1);
+}
+
+//默认hash，整型key使用mix_integer_hash，字符串使用带种子的hash_bytes，其它类型同std::hash
+template <class Key, class Enable = void>
+struct DelayDeleteHash : public std::hash<Key> {
+};
+
+//字符串hash，is_transparent，可以直接用const char*、std::string_view查找
+template <>
+struct DelayDeleteHash<std::string> {
+  typedef void is_transparent;
+  explicit DelayDeleteHash(uint64_t seed = default_hash_seed()) : seed_(seed) {}
+  size_t operator()(const std::string& key) const {
+    return hash_bytes(key.data(), key.size(), seed_);
+  }
+  size_t operator()(const char* key) const {
+    return hash_bytes(key, strlen(key), seed_);
+  }
+#if __cplusplus >= 201703L
+  size_t operator()(std::string_view key) const {
+    return hash_bytes(key.data(), key.size(), seed_);
+  }
+#endif
+  uint64_t seed_;
+};
+
+template <class Key>
+struct DelayDeleteHash<Key, typename std::enable_if<std::is_integral<Key>::value>::type> {
+  size_t operator()(Key key) const {
+    return static_cast<size_t>(mix_integer_hash(static_cast<uint64_t>(key)));
+  }
+};
+
+//默认比较函数，字符串比较是transparent的
+template <class Key>
+struct DelayDeleteEqual : public std::equal_to<Key> {
+};
+
+template <>
+struct DelayDeleteEqual<std::string> {
+  typedef void is_transparent;
+  template <class A, class B>
+  bool operator()(const A& a, const B& b) const {
+    return a == b;
+  }
+};
+
+//hash值相等能否推出key相等。
+//为true时table只比较节点中缓存的hash值，不再访问p_value中的key。
+template <class Key, class Hash, class Equal>
+struct HashIdentifiesKey
+    : public std::integral_constant<bool,
+        std::is_same<Hash, DelayDeleteHash<Key> >::value &&
+        (std::is_same<Equal, std::equal_to<Key> >::value ||
+         std::is_same<Equal, DelayDeleteEqual<Key> >::value) &&
+        std::is_integral<Key>::value &&
+        sizeof(Key) <= sizeof(uint64_t) &&
+        sizeof(size_t) >= sizeof(uint64_t)> {
+};
+
+template <class T, class Enable = void>
+struct HasIsTransparent : public std::false_type {
+};
+
+template <class T>
+struct HasIsTransparent<T, typename std::conditional<true, void, typename T::is_transparent>::type>
+    : public std::true_type {
+};
+
+//Hash和Equal都是transparent时，map提供按任意可比较类型查找的接口
+template <class Hash, class Equal>
+struct IsTransparentLookup
+    : public std::integral_constant<bool,
+        HasIsTransparent<Hash>::value && HasIsTransparent<Equal>::value> {
+};
+
+}
+
+#endif
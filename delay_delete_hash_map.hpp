@@ -2,22 +2,32 @@
 #define UTILS_DELAY_DELETED_HASH_MAP_HPP_
 
 #include <utility>
+#include <memory>
+#include <string>
 #include <type_traits>
 #include <initializer_list>
 #include "delay_delete_allocator.hpp"
+#include "delay_delete_hash.hpp"
 #include "delay_delete_table.hpp"
+#include "delay_delete_update_queue.hpp"
+#include "delay_delete_wal.hpp"
+#include "delay_delete_write_batch.hpp"
 
 namespace utils {
 
 template <class Key, class Val,
           class Alloc = DelayDeleteAllocator<std::pair<const Key, Val> >,
-          class Equal = std::equal_to<Key>,
-          class Hash = std::hash<Key> >
+          class Equal = DelayDeleteEqual<Key>,
+          class Hash = DelayDeleteHash<Key> >
 class DelayDeleteHashMap {
  private:
   typedef DelayDeleteHashtable<Key, std::pair<const Key, Val>, Alloc,
             std::_Select1st<std::pair<const Key, Val>>, Equal, Hash> HashTable; 
+  typedef DelayDeleteUpdateQueue<Key, std::pair<const Key, Val>, Hash, Equal> UpdateQueue;
+  typedef DelayDeleteTableLog<std::pair<const Key, Val> > TableLog;
   HashTable ht_;
+  UpdateQueue queue_;
+  std::unique_ptr<TableLog> wal_;
 
  public:
   typedef Val data_type; 
@@ -30,6 +40,8 @@ class DelayDeleteHashMap {
   typedef typename HashTable::const_pointer const_pointer;
   typedef typename HashTable::iterator iterator;
   typedef typename HashTable::const_iterator const_iterator;
+  typedef DelayDeleteWriteBatch<key_type, value_type> write_batch;
+  typedef typename HashTable::Snapshot snapshot_type;
 
  public:
   DelayDeleteHashMap() {}
@@ -38,13 +50,25 @@ class DelayDeleteHashMap {
   DelayDeleteHashMap& operator = (const DelayDeleteHashMap& other) { ht_ = other.ht_;}
   DelayDeleteHashMap& operator = (const DelayDeleteHashMap&& other) { ht_ = other.ht_;}
   int init(size_type n) { return ht_.init(n); }
+  int enable_bloom_filter(size_type bits_per_item = 10, double rebuild_ratio = 0.25) {
+    return ht_.enable_bloom_filter(bits_per_item, rebuild_ratio);
+  }
   size_type size() const { return ht_.size(); }
   size_type resize_count() const { return ht_.resize_count(); }
+  size_type version() const { return ht_.version(); }
   bool empty() const { return ht_.empty(); }
   iterator begin() { return ht_.begin(); }
   iterator end() { return ht_.end(); }
   const_iterator begin() const { return ht_.begin(); }
   const_iterator end() const { return ht_.end(); }
+  //全表遍历时使用，遍历结果是创建时刻的内容：之后的第一次写先复制一份桶数组，再修改共享的链前先复制链。
+  //快照存活期间garbage_collect不回收任何内存，遍历完应尽快释放
+  snapshot_type snapshot() { return ht_.snapshot(); }
+  //查找前预取桶和链头的value，见delay_delete_coro_lookup.hpp
+  template <class K>
+  void prefetch(const K& key) const { ht_.prefetch(key); }
+  template <class K>
+  void prefetch_chain(const K& key) const { ht_.prefetch_chain(key); }
 
   std::pair<iterator, bool> insert(
                               const value_type& obj,
@@ -65,24 +89,93 @@ class DelayDeleteHashMap {
 
   size_type count(const key_type& key) { return ht_.count(key); }
   void erase(const key_type& key) { ht_.erase(key); }
+
+  //Hash和Equal都是transparent时，可以不构造key_type直接查找，如std::string key用const char*查找
+  template <class K, class H = Hash, class E = Equal,
+            class = typename std::enable_if<IsTransparentLookup<H, E>::value &&
+                                            !std::is_convertible<const K&, iterator>::value>::type>
+  iterator find(const K& key) { return ht_.find(key); }
+  template <class K, class H = Hash, class E = Equal,
+            class = typename std::enable_if<IsTransparentLookup<H, E>::value>::type>
+  size_type count(const K& key) { return ht_.count(key); }
+  template <class K, class H = Hash, class E = Equal,
+            class = typename std::enable_if<IsTransparentLookup<H, E>::value &&
+                                            !std::is_convertible<const K&, iterator>::value>::type>
+  void erase(const K& key) { ht_.erase(key); }
   void erase(iterator it) { ht_.erase(it); } 
   void erase(iterator f, iterator l) { ht_.erase(f, l); }
 
-  void clear() { ht_.clear(); }
+  //batch中的insert按insert(替换)执行，全部操作对读线程一次可见
+  int write(const write_batch& batch) { return ht_.write_batch(batch, true); }
+
+  //开启写前日志，dir中已有checkpoint和日志时先恢复到map，见DelayDeleteWal。
+  //之后的修改在commit返回0后持久化，checkpoint重写修改过的分区并删除旧日志。
+  //开启后不要对map赋值，赋值不记录日志
+  int enable_wal(const std::string& dir, const DelayDeleteWalOptions& options = DelayDeleteWalOptions()) {
+    if (wal_) {
+      return -1;
+    }
+    std::unique_ptr<DelayDeleteWal<Key, Val, HashTable> > wal(new DelayDeleteWal<Key, Val, HashTable>());
+    if (wal->open(dir, options, &ht_, true) != 0) {
+      return -1;
+    }
+    ht_.set_log(wal.get());
+    wal_ = std::move(wal);
+    return 0;
+  }
+  int commit() { return wal_ ? wal_->commit() : -1; }
+  int checkpoint() { return wal_ ? wal_->checkpoint() : -1; }
+
+  //更新队列，可以在任意线程调用，不阻塞。操作在写线程apply_updates后才可见
+  void push_insert(const value_type& obj) { queue_.push_insert(obj.first, obj); }
+  void push_update(const value_type& obj) { queue_.push_update(obj.first, obj); }
+  void push_erase(const Key& key) { queue_.push_erase(key); }
+
+  //写线程调用，从队列取出最多max_op个操作，同一key的操作合并为一次，
+  //再逐个按insert(替换)或erase执行，每个操作执行后立即对读线程可见。返回取出的操作数
+  size_type apply_updates(size_type max_op = 4096) {
+    return queue_.drain(max_op,
+        [this](const Key& key) { return bool(ht_.find(key)); },
+        [this](const Key& key, const value_type* obj) {
+          if (obj) {
+            ht_.insert_unique(*obj, true, true);
+          } else {
+            ht_.erase(key);
+          }
+        });
+  }
+
+  template <class Pred>
+  size_type erase_if(Pred pred, size_type n_thread = 1) { return ht_.erase_if(pred, n_thread); }
+  template <class Pred>
+  size_type retain(Pred pred, size_type n_thread = 1) { return ht_.retain(pred, n_thread); }
+
+  void clear() {
+    if (wal_) {
+      wal_->log_clear();
+    }
+    ht_.clear();
+  }
   size_type bucket_count() {return ht_.bucket_count(); }
 
+  bool compact(size_type budget) { return ht_.compact(budget); }
+  void enable_hit_sampling(size_type sample_period = 64) { ht_.enable_hit_sampling(sample_period); }
+  size_type reorder_hot_nodes(size_type max_bucket) { return ht_.reorder_hot_nodes(max_bucket); }
+
   void garbage_collect() { ht_.garbage_collect(); } 
 };
 
 template <class Key, class Val,
           class Alloc = DelayDeleteAllocator<std::pair<const Key, Val> >,
-          class Equal = std::equal_to<Key>,
-          class Hash = std::hash<Key> >
+          class Equal = DelayDeleteEqual<Key>,
+          class Hash = DelayDeleteHash<Key> >
 class DelayDeleteMultiHashMap {
  private:
   typedef DelayDeleteHashtable<Key, std::pair<const Key, Val>, Alloc,
             std::_Select1st<std::pair<const Key, Val>>, Equal, Hash> HashTable; 
+  typedef DelayDeleteTableLog<std::pair<const Key, Val> > TableLog;
   HashTable ht_;
+  std::unique_ptr<TableLog> wal_;
 
  public:
   typedef Val data_type; 
@@ -95,6 +188,8 @@ class DelayDeleteMultiHashMap {
   typedef typename HashTable::const_pointer const_pointer;
   typedef typename HashTable::iterator iterator;
   typedef typename HashTable::const_iterator const_iterator;
+  typedef DelayDeleteWriteBatch<key_type, value_type> write_batch;
+  typedef typename HashTable::Snapshot snapshot_type;
   typedef typename HashTable::value_cmp value_cmp;
   typedef typename HashTable::value_equal value_equal;
 
@@ -105,13 +200,25 @@ class DelayDeleteMultiHashMap {
   DelayDeleteMultiHashMap& operator = (const DelayDeleteMultiHashMap& other) { ht_ = other.ht_;}
   DelayDeleteMultiHashMap& operator = (const DelayDeleteMultiHashMap&& other) { ht_ = other.ht_;}
   int init(size_type n) { return ht_.init(n); }
+  int enable_bloom_filter(size_type bits_per_item = 10, double rebuild_ratio = 0.25) {
+    return ht_.enable_bloom_filter(bits_per_item, rebuild_ratio);
+  }
   size_type resize_count() const { return ht_.resize_count(); }
+  size_type version() const { return ht_.version(); }
   size_type size() const { return ht_.size(); }
   bool empty() const { return ht_.empty(); }
   iterator begin() { return ht_.begin(); }
   iterator end() { return ht_.end(); }
   const_iterator begin() const { return ht_.begin(); }
   const_iterator end() const { return ht_.end(); }
+  //全表遍历时使用，遍历结果是创建时刻的内容：之后的第一次写先复制一份桶数组，再修改共享的链前先复制链。
+  //快照存活期间garbage_collect不回收任何内存，遍历完应尽快释放
+  snapshot_type snapshot() { return ht_.snapshot(); }
+  //查找前预取桶和链头的value，见delay_delete_coro_lookup.hpp
+  template <class K>
+  void prefetch(const K& key) const { ht_.prefetch(key); }
+  template <class K>
+  void prefetch_chain(const K& key) const { ht_.prefetch_chain(key); }
   
   iterator insert_with_value_cmp(const Key& k, const Val& v, value_cmp cmp, bool is_resize = true, bool is_replace = true) {
     //相同key的value值不能重复
@@ -138,15 +245,68 @@ class DelayDeleteMultiHashMap {
   std::pair<iterator, iterator> equal_range(const key_type& key) {
     return ht_.equal_range(key);
   }
+  template <class K, class H = Hash, class E = Equal,
+            class = typename std::enable_if<IsTransparentLookup<H, E>::value>::type>
+  std::pair<iterator, iterator> equal_range(const K& key) {
+    return ht_.equal_range(key);
+  }
   size_type count(const key_type& key) { return ht_.count(key); }
   void erase(const key_type& key) { ht_.erase(key); }
+
+  //Hash和Equal都是transparent时，可以不构造key_type直接查找，如std::string key用const char*查找
+  template <class K, class H = Hash, class E = Equal,
+            class = typename std::enable_if<IsTransparentLookup<H, E>::value &&
+                                            !std::is_convertible<const K&, iterator>::value>::type>
+  iterator find(const K& key) { return ht_.find(key); }
+  template <class K, class H = Hash, class E = Equal,
+            class = typename std::enable_if<IsTransparentLookup<H, E>::value>::type>
+  size_type count(const K& key) { return ht_.count(key); }
+  template <class K, class H = Hash, class E = Equal,
+            class = typename std::enable_if<IsTransparentLookup<H, E>::value &&
+                                            !std::is_convertible<const K&, iterator>::value>::type>
+  void erase(const K& key) { ht_.erase(key); }
   void erase(iterator it) { ht_.erase(it); } 
   void erase(iterator f, iterator l) { ht_.erase(f, l); }
   void erase(const key_type& key, value_equal value_equal_fun) { ht_.erase(key, value_equal_fun); }
 
-  void clear() { ht_.clear(); }
+  //batch中的insert按insert执行，全部操作对读线程一次可见
+  int write(const write_batch& batch) { return ht_.write_batch(batch, false); }
+
+  //开启写前日志，dir中已有checkpoint和日志时先恢复到map，见DelayDeleteWal。
+  //之后的修改在commit返回0后持久化，checkpoint重写修改过的分区并删除旧日志。
+  //开启后不要对map赋值，赋值不记录日志
+  int enable_wal(const std::string& dir, const DelayDeleteWalOptions& options = DelayDeleteWalOptions()) {
+    if (wal_) {
+      return -1;
+    }
+    std::unique_ptr<DelayDeleteWal<Key, Val, HashTable> > wal(new DelayDeleteWal<Key, Val, HashTable>());
+    if (wal->open(dir, options, &ht_, false) != 0) {
+      return -1;
+    }
+    ht_.set_log(wal.get());
+    wal_ = std::move(wal);
+    return 0;
+  }
+  int commit() { return wal_ ? wal_->commit() : -1; }
+  int checkpoint() { return wal_ ? wal_->checkpoint() : -1; }
+
+  template <class Pred>
+  size_type erase_if(Pred pred, size_type n_thread = 1) { return ht_.erase_if(pred, n_thread); }
+  template <class Pred>
+  size_type retain(Pred pred, size_type n_thread = 1) { return ht_.retain(pred, n_thread); }
+
+  void clear() {
+    if (wal_) {
+      wal_->log_clear();
+    }
+    ht_.clear();
+  }
   size_type bucket_count() {return ht_.bucket_count(); }
 
+  bool compact(size_type budget) { return ht_.compact(budget); }
+  void enable_hit_sampling(size_type sample_period = 64) { ht_.enable_hit_sampling(sample_period); }
+  size_type reorder_hot_nodes(size_type max_bucket) { return ht_.reorder_hot_nodes(max_bucket); }
+
   void garbage_collect() { ht_.garbage_collect(); } 
 };
 
@@ -0,0 +1,85 @@
+#ifndef UTILS_DELAY_DELETE_HUGE_PAGE_HPP_
+#define UTILS_DELAY_DELETE_HUGE_PAGE_HPP_
+
+#include <memory.h>
+#include <stdlib.h>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace utils {
+
+//桶数组、bloom filter、compact arena等大块内存的分配。
+//不小于kHugePageSize的块使用mmap，依次尝试hugetlbfs(MAP_HUGETLB)
+//和透明大页(MADV_HUGEPAGE)，都不可用时退回堆分配。
+//mmap得到的匿名页本身为0，不需要memset；堆分配时memset清零。
+//返回的内存按64字节对齐，块前64字节记录分配方式。
+static const size_t kHugePageSize = 2 * 1024 * 1024;
+static const size_t kHugePageHeader = 64;
+
+struct HugePageHeader {
+  size_t map_len;     // 0 表示堆分配
+};
+
+inline void* huge_page_alloc(size_t bytes) {
+  size_t len = bytes + kHugePageHeader;
+  char* base = nullptr;
+  size_t map_len = 0;
+#ifdef __linux__
+  if (len >= kHugePageSize) {
+    map_len = (len + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+    void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    p = mmap(nullptr, map_len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (MAP_FAILED == p) {
+      p = mmap(nullptr, map_len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+      if (MAP_FAILED != p) {
+        //透明大页不可用时madvise失败，仍然使用普通页
+        madvise(p, map_len, MADV_HUGEPAGE);
+      }
+#endif
+    }
+    if (MAP_FAILED == p) {
+      map_len = 0;
+    } else {
+      base = static_cast<char*>(p);
+    }
+  }
+#endif
+  if (!base) {
+    void* p = nullptr;
+    if (posix_memalign(&p, kHugePageHeader, len) != 0) {
+      return nullptr;
+    }
+    base = static_cast<char*>(p);
+    memset(base, 0, len);
+  }
+  reinterpret_cast<HugePageHeader*>(base)->map_len = map_len;
+  return base + kHugePageHeader;
+}
+
+inline void huge_page_free(void* p) {
+  if (!p) {
+    return;
+  }
+  char* base = static_cast<char*>(p) - kHugePageHeader;
+  size_t map_len = reinterpret_cast<HugePageHeader*>(base)->map_len;
+#ifdef __linux__
+  if (map_len) {
+    munmap(base, map_len);
+    return;
+  }
+#endif
+  free(base);
+}
+
+}
+
+#endif
@@ -0,0 +1,689 @@
+#ifndef UTILS_DELAY_DELETE_SHM_HASH_MAP_HPP_
+#define UTILS_DELAY_DELETE_SHM_HASH_MAP_HPP_
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <type_traits>
+#include "delay_delete_allocator.hpp"
+#include "delay_delete_hash.hpp"
+#include "delay_delete_table.hpp"
+
+namespace utils {
+
+//放在posix共享内存中的delay delete hashmap。
+//一个写进程创建并更新，多个读进程以只读方式映射数据区。
+//段内使用偏移量代替指针，节点和桶数组由段内分配器管理。
+//删除对象先挂到retired链表，记录retire时的epoch；
+//读线程在读之前把当前epoch写入自己的slot，写进程garbage_collect时
+//只回收比所有活跃读者epoch都小的对象。读进程的每个线程各自登记一个slot。
+//Key Val 必须是trivially copyable，且hash函数在各进程间结果一致。
+static const uint64_t kShmHashMapMagic = 0x44444853484d3032ull;  // "DDHSHM02"
+static const size_t kShmMaxReaders = 1024;
+static const size_t kShmAlign = 16;
+
+struct ShmReaderSlot {
+  std::atomic<uint64_t> pid;     // 0 表示slot空闲
+  std::atomic<uint64_t> epoch;   // 0 表示读者不在读
+  std::atomic<uint64_t> owner;   // 登记slot的attach，见ShmLiveAttachments
+  char pad[40];
+};
+
+//进程内仍然attach着的读者。线程退出和detach都在mutex下释放slot，
+//线程退出时只释放仍然attach的slot，detach之后段已经unmap
+struct ShmLiveAttachments {
+  std::mutex mutex;
+  std::set<uint64_t> tokens;
+  uint64_t next_token {1};
+};
+
+inline ShmLiveAttachments& shm_live_attachments() {
+  static ShmLiveAttachments live;
+  return live;
+}
+
+//一个线程在一个attach上的slot和ReadGuard嵌套深度
+struct ShmThreadReader {
+  uint64_t token;
+  ShmReaderSlot* slot;    // nullptr 表示slot用完，使用进程共享的slot
+  int depth;
+};
+
+struct ShmThreadReaders {
+  std::deque<ShmThreadReader> readers;   // deque追加时不移动已有元素
+  ~ShmThreadReaders() {
+    ShmLiveAttachments& live = shm_live_attachments();
+    std::lock_guard<std::mutex> lock(live.mutex);
+    for (size_t i = 0; i < readers.size(); ++i) {
+      ShmReaderSlot* slot = readers[i].slot;
+      if (slot && live.tokens.count(readers[i].token)) {
+        slot->epoch.store(0);
+        slot->owner.store(0);
+        slot->pid.store(0);
+      }
+    }
+  }
+};
+
+inline ShmThreadReaders& shm_thread_readers() {
+  static thread_local ShmThreadReaders readers;
+  return readers;
+}
+
+//段头部，读写进程都以读写方式映射
+struct ShmSegmentHeader {
+  uint64_t magic;
+  uint64_t segment_size;
+  uint64_t data_offset;                // 数据区在段中的偏移，页对齐
+  uint64_t node_size;                  // 用于校验读写进程的模板参数一致
+  std::atomic<uint64_t> table_off;     // 当前桶数组
+  std::atomic<uint64_t> global_epoch;
+  std::atomic<uint64_t> n_item;
+  std::atomic<uint64_t> resize_count;
+  //以下只有写进程访问
+  uint64_t alloc_top;                  // bump分配位置
+  uint64_t free_node_list;             // 节点大小的空闲块
+  uint64_t free_large_list;            // 其它大小的空闲块，first fit
+  uint64_t retired_list;               // 等待回收的块
+  ShmReaderSlot readers[kShmMaxReaders];
+};
+
+//段内每个分配块的头
+struct ShmBlock {
+  uint64_t size;          // 含块头的大小
+  uint64_t next;
+  uint64_t retire_epoch;
+  uint64_t pad;
+};
+
+//桶数组描述，后面紧跟nbucket个std::atomic<uint64_t>
+struct ShmTable {
+  uint64_t nbucket;
+  uint64_t pad;
+};
+
+template <class Key, class Val,
+          class Equal = DelayDeleteEqual<Key>,
+          class Hash = DelayDeleteHash<Key> >
+class DelayDeleteShmHashMap {
+  static_assert(std::is_trivially_copyable<Key>::value, "shm key must be trivially copyable");
+  static_assert(std::is_trivially_copyable<Val>::value, "shm value must be trivially copyable");
+
+  struct Node {
+    std::atomic<uint64_t> next;
+    uint64_t hash;
+    Key key;
+    Val val;
+  };
+
+ public:
+  typedef Key key_type;
+  typedef Val mapped_type;
+  typedef std::size_t size_type;
+
+  //读者在访问map前持有guard，guard析构前find返回的指针有效。
+  //每个线程使用自己的slot，可以嵌套，最外层guard析构时才清除epoch
+  class ReadGuard {
+   public:
+    explicit ReadGuard(const DelayDeleteShmHashMap& m) : map_(&m), reader_(m.thread_reader()) {
+      if (reader_ && 0 == reader_->depth++) {
+        map_->enter(reader_);
+      }
+    }
+    ~ReadGuard() {
+      if (reader_ && 0 == --reader_->depth) {
+        map_->leave(reader_);
+      }
+    }
+   private:
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator = (const ReadGuard&) = delete;
+    const DelayDeleteShmHashMap* map_;
+    ShmThreadReader* reader_;
+  };
+
+  DelayDeleteShmHashMap() {}
+  ~DelayDeleteShmHashMap() {
+    detach();
+  }
+
+  //写进程创建共享内存段。已存在的同名段先unlink再新建，不截断旧段：
+  //仍映射旧段的读进程继续读旧数据，重新attach后才读到新段
+  int create(const char* name, size_t segment_size, size_t n) {
+    detach();
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t data_offset = (sizeof(ShmSegmentHeader) + page - 1) / page * page;
+    if (segment_size <= data_offset) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " segment too small " << segment_size << std::endl;
+      return -1;
+    }
+    if (shm_unlink(name) != 0 && ENOENT != errno) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " shm_unlink fail " << name << " errno " << errno << std::endl;
+      return -1;
+    }
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " shm_open fail " << name << " errno " << errno << std::endl;
+      return -1;
+    }
+    if (ftruncate(fd, segment_size) != 0) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " ftruncate fail " << segment_size << std::endl;
+      close(fd);
+      return -1;
+    }
+    void* base = mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == base) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " mmap fail errno " << errno << std::endl;
+      return -1;
+    }
+    header_ = static_cast<ShmSegmentHeader*>(base);
+    header_len_ = segment_size;
+    data_ = static_cast<char*>(base) + data_offset;
+    data_len_ = 0;
+    is_writer_ = true;
+
+    ShmSegmentHeader* h = header_;
+    h->segment_size = segment_size;
+    h->data_offset = data_offset;
+    h->node_size = sizeof(Node);
+    h->table_off.store(0);
+    h->global_epoch.store(1);
+    h->n_item.store(0);
+    h->resize_count.store(0);
+    h->alloc_top = sizeof(ShmBlock);  // 偏移0保留为空指针
+    h->free_node_list = 0;
+    h->free_large_list = 0;
+    h->retired_list = 0;
+    for (size_t i = 0; i < kShmMaxReaders; ++i) {
+      h->readers[i].pid.store(0);
+      h->readers[i].epoch.store(0);
+      h->readers[i].owner.store(0);
+    }
+    uint64_t tab = new_table(find_near_prime(n));
+    if (!tab) {
+      detach();
+      return -1;
+    }
+    h->table_off.store(tab, std::memory_order_release);
+    //magic最后写入，读者据此判断段已初始化
+    std::atomic_thread_fence(std::memory_order_release);
+    h->magic = kShmHashMapMagic;
+    return 0;
+  }
+
+  //读进程映射已存在的段，头部可写(用于登记epoch)，数据区只读
+  int attach(const char* name) {
+    detach();
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " shm_open fail " << name << " errno " << errno << std::endl;
+      return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ShmSegmentHeader)) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " bad segment " << name << std::endl;
+      close(fd);
+      return -1;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t header_len = (sizeof(ShmSegmentHeader) + page - 1) / page * page;
+    void* hbase = mmap(nullptr, header_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == hbase) {
+      close(fd);
+      return -1;
+    }
+    ShmSegmentHeader* h = static_cast<ShmSegmentHeader*>(hbase);
+    if (h->magic != kShmHashMapMagic || h->node_size != sizeof(Node) ||
+        h->data_offset != header_len || h->segment_size != (size_t)st.st_size) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " segment mismatch " << name << std::endl;
+      munmap(hbase, header_len);
+      close(fd);
+      return -1;
+    }
+    size_t data_len = h->segment_size - h->data_offset;
+    void* dbase = mmap(nullptr, data_len, PROT_READ, MAP_SHARED, fd, h->data_offset);
+    close(fd);
+    if (MAP_FAILED == dbase) {
+      munmap(hbase, header_len);
+      return -1;
+    }
+    header_ = h;
+    header_len_ = header_len;
+    data_ = static_cast<char*>(dbase);
+    data_len_ = data_len;
+    is_writer_ = false;
+    {
+      ShmLiveAttachments& live = shm_live_attachments();
+      std::lock_guard<std::mutex> lock(live.mutex);
+      attach_token_ = live.next_token++;
+      live.tokens.insert(attach_token_);
+    }
+    //进程共享的slot，线程slot用完时使用
+    reader_slot_ = claim_slot();
+    if (!reader_slot_) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " no free reader slot" << std::endl;
+      detach();
+      return -1;
+    }
+    return 0;
+  }
+
+  void detach() {
+    if (!header_) {
+      return;
+    }
+    if (attach_token_) {
+      //释放本次attach登记的所有slot，包括各线程的slot
+      ShmLiveAttachments& live = shm_live_attachments();
+      std::lock_guard<std::mutex> lock(live.mutex);
+      live.tokens.erase(attach_token_);
+      for (size_t i = 0; i < kShmMaxReaders; ++i) {
+        ShmReaderSlot& slot = header_->readers[i];
+        if (slot.owner.load() == attach_token_) {
+          slot.epoch.store(0);
+          slot.owner.store(0);
+          slot.pid.store(0);
+        }
+      }
+      attach_token_ = 0;
+      reader_slot_ = nullptr;
+      shared_depth_ = 0;
+    }
+    if (data_len_) {
+      munmap(data_, data_len_);
+    }
+    munmap(header_, header_len_);
+    header_ = nullptr;
+    data_ = nullptr;
+    header_len_ = 0;
+    data_len_ = 0;
+  }
+
+  static int remove(const char* name) {
+    return shm_unlink(name);
+  }
+
+  size_type size() const {
+    return header_ ? header_->n_item.load(std::memory_order_relaxed) : 0;
+  }
+  size_type resize_count() const {
+    return header_ ? header_->resize_count.load(std::memory_order_relaxed) : 0;
+  }
+  size_type bucket_count() const {
+    const ShmTable* t = table();
+    return t ? t->nbucket : 0;
+  }
+
+  //读接口，需要在ReadGuard内调用
+  const Val* find(const Key& key) const {
+    const ShmTable* t = table();
+    if (!t) {
+      return nullptr;
+    }
+    uint64_t h = hash_func_(key);
+    uint64_t off = slots(t)[h % t->nbucket].load(std::memory_order_acquire);
+    while (off) {
+      const Node* n = node(off);
+      if (n->hash == h && equals_(key, n->key)) {
+        return &n->val;
+      }
+      off = n->next.load(std::memory_order_acquire);
+    }
+    return nullptr;
+  }
+
+  //拷贝出value，自带ReadGuard
+  bool get(const Key& key, Val* val) const {
+    ReadGuard guard(*this);
+    const Val* v = find(key);
+    if (!v) {
+      return false;
+    }
+    memcpy(static_cast<void*>(val), v, sizeof(Val));
+    return true;
+  }
+
+  size_type count(const Key& key) const {
+    ReadGuard guard(*this);
+    return find(key) ? 1 : 0;
+  }
+
+  //写接口，只能在写进程单线程调用
+  //返回 1 插入或替换成功，0 已存在且不替换，-1 段内空间不足
+  int insert(const Key& key, const Val& val, bool is_resize = true, bool is_replace = true) {
+    if (!is_writer_) {
+      return -1;
+    }
+    if (is_resize) {
+      resize();
+    }
+    ShmTable* t = table();
+    std::atomic<uint64_t>* bkt = slots(t);
+    uint64_t h = hash_func_(key);
+    size_t bkt_num = h % t->nbucket;
+    uint64_t first = bkt[bkt_num].load(std::memory_order_relaxed);
+    for (uint64_t pre = 0, cur = first; cur; pre = cur, cur = node(cur)->next.load(std::memory_order_relaxed)) {
+      Node* n = node(cur);
+      if (n->hash == h && equals_(key, n->key)) {
+        if (!is_replace) {
+          return 0;
+        }
+        uint64_t tmp = new_node(h, key, val, n->next.load(std::memory_order_relaxed));
+        if (!tmp) {
+          return -1;
+        }
+        link(bkt, bkt_num, pre, tmp);
+        retire(cur);
+        return 1;
+      }
+    }
+    uint64_t tmp = new_node(h, key, val, first);
+    if (!tmp) {
+      return -1;
+    }
+    bkt[bkt_num].store(tmp, std::memory_order_release);
+    header_->n_item.fetch_add(1, std::memory_order_relaxed);
+    return 1;
+  }
+
+  void erase(const Key& key) {
+    if (!is_writer_) {
+      return;
+    }
+    ShmTable* t = table();
+    std::atomic<uint64_t>* bkt = slots(t);
+    uint64_t h = hash_func_(key);
+    size_t bkt_num = h % t->nbucket;
+    uint64_t first = bkt[bkt_num].load(std::memory_order_relaxed);
+    for (uint64_t pre = 0, cur = first; cur; pre = cur, cur = node(cur)->next.load(std::memory_order_relaxed)) {
+      Node* n = node(cur);
+      if (n->hash == h && equals_(key, n->key)) {
+        link(bkt, bkt_num, pre, n->next.load(std::memory_order_relaxed));
+        retire(cur);
+        header_->n_item.fetch_sub(1, std::memory_order_relaxed);
+        return;
+      }
+    }
+  }
+
+  //负载超过max_load_factor时在段内新建桶数组，复制节点后切换
+  void resize() {
+    ShmTable* t = table();
+    size_t n_item = header_->n_item.load(std::memory_order_relaxed);
+    if (n_item / (double)t->nbucket <= max_load_factor_) {
+      return;
+    }
+    size_t nbucket = find_near_prime(t->nbucket + 1);
+    uint64_t new_tab = new_table(nbucket);
+    if (!new_tab) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " delay_delete_shm resize no memory" << std::endl;
+      return;
+    }
+    std::atomic<uint64_t>* sbkt = slots(t);
+    std::atomic<uint64_t>* dbkt = slots(table(new_tab));
+    for (size_t i = 0; i < t->nbucket; ++i) {
+      for (uint64_t cur = sbkt[i].load(std::memory_order_relaxed); cur; cur = node(cur)->next.load(std::memory_order_relaxed)) {
+        Node* n = node(cur);
+        size_t bkt_num = n->hash % nbucket;
+        uint64_t tmp = new_node(n->hash, n->key, n->val, dbkt[bkt_num].load(std::memory_order_relaxed));
+        if (!tmp) {
+          //空间不足，放弃本次resize，新表还未发布，可以直接释放
+          free_table(new_tab, nbucket);
+          std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " delay_delete_shm resize no memory" << std::endl;
+          return;
+        }
+        dbkt[bkt_num].store(tmp, std::memory_order_relaxed);
+      }
+    }
+    uint64_t old_tab = header_->table_off.load(std::memory_order_relaxed);
+    header_->table_off.store(new_tab, std::memory_order_release);
+    header_->resize_count.fetch_add(1, std::memory_order_relaxed);
+    //旧表及其节点延迟回收
+    for (size_t i = 0; i < t->nbucket; ++i) {
+      for (uint64_t cur = sbkt[i].load(std::memory_order_relaxed); cur; ) {
+        uint64_t next = node(cur)->next.load(std::memory_order_relaxed);
+        retire(cur);
+        cur = next;
+      }
+    }
+    retire(old_tab);
+  }
+
+  //推进epoch，回收所有活跃读者都已经看不到的块
+  void garbage_collect() {
+    if (!is_writer_) {
+      return;
+    }
+    header_->global_epoch.fetch_add(1);
+    uint64_t min_epoch = (uint64_t)-1;
+    for (size_t i = 0; i < kShmMaxReaders; ++i) {
+      ShmReaderSlot& slot = header_->readers[i];
+      uint64_t pid = slot.pid.load();
+      if (!pid) {
+        continue;
+      }
+      if (kill((pid_t)pid, 0) != 0 && ESRCH == errno) {
+        //读进程已退出，释放其slot
+        slot.epoch.store(0);
+        slot.owner.store(0);
+        slot.pid.store(0);
+        continue;
+      }
+      uint64_t e = slot.epoch.load();
+      if (e && e < min_epoch) {
+        min_epoch = e;
+      }
+    }
+    uint64_t* pre = &header_->retired_list;
+    uint64_t cur = *pre;
+    while (cur) {
+      ShmBlock* b = block(cur);
+      uint64_t next = b->next;
+      if (b->retire_epoch < min_epoch) {
+        *pre = next;
+        free_block(cur);
+      } else {
+        pre = &b->next;
+      }
+      cur = next;
+    }
+  }
+
+ private:
+  DelayDeleteShmHashMap(const DelayDeleteShmHashMap&) = delete;
+  DelayDeleteShmHashMap& operator = (const DelayDeleteShmHashMap&) = delete;
+
+  static uint64_t node_block_size() {
+    return sizeof(ShmBlock) + (sizeof(Node) + kShmAlign - 1) / kShmAlign * kShmAlign;
+  }
+
+  ShmBlock* block(uint64_t off) const {
+    return reinterpret_cast<ShmBlock*>(data_ + off - sizeof(ShmBlock));
+  }
+  Node* node(uint64_t off) const {
+    return reinterpret_cast<Node*>(data_ + off);
+  }
+  ShmTable* table(uint64_t off) const {
+    return reinterpret_cast<ShmTable*>(data_ + off);
+  }
+  ShmTable* table() const {
+    if (!header_) {
+      return nullptr;
+    }
+    uint64_t off = header_->table_off.load(std::memory_order_acquire);
+    return off ? table(off) : nullptr;
+  }
+  static std::atomic<uint64_t>* slots(const ShmTable* t) {
+    return reinterpret_cast<std::atomic<uint64_t>*>(const_cast<ShmTable*>(t) + 1);
+  }
+
+  //返回payload偏移，0表示空间不足
+  uint64_t allocate(uint64_t n) {
+    uint64_t sz = sizeof(ShmBlock) + (n + kShmAlign - 1) / kShmAlign * kShmAlign;
+    uint64_t* list = sz == node_block_size() ? &header_->free_node_list : &header_->free_large_list;
+    for (uint64_t* pre = list; *pre; pre = &block(*pre)->next) {
+      ShmBlock* b = block(*pre);
+      if (b->size >= sz) {
+        uint64_t off = *pre;
+        *pre = b->next;
+        b->next = 0;
+        return off;
+      }
+    }
+    uint64_t data_size = header_->segment_size - header_->data_offset;
+    if (header_->alloc_top + sz > data_size) {
+      return 0;
+    }
+    ShmBlock* b = reinterpret_cast<ShmBlock*>(data_ + header_->alloc_top);
+    b->size = sz;
+    b->next = 0;
+    b->retire_epoch = 0;
+    header_->alloc_top += sz;
+    return header_->alloc_top - sz + sizeof(ShmBlock);
+  }
+
+  void free_block(uint64_t off) {
+    ShmBlock* b = block(off);
+    uint64_t* list = b->size == node_block_size() ? &header_->free_node_list : &header_->free_large_list;
+    b->next = *list;
+    *list = off;
+  }
+
+  void retire(uint64_t off) {
+    ShmBlock* b = block(off);
+    b->retire_epoch = header_->global_epoch.load(std::memory_order_relaxed);
+    b->next = header_->retired_list;
+    header_->retired_list = off;
+  }
+
+  uint64_t new_node(uint64_t h, const Key& key, const Val& val, uint64_t next) {
+    uint64_t off = allocate(sizeof(Node));
+    if (!off) {
+      return 0;
+    }
+    Node* n = node(off);
+    n->next.store(next, std::memory_order_relaxed);
+    n->hash = h;
+    memcpy(static_cast<void*>(&n->key), &key, sizeof(Key));
+    memcpy(static_cast<void*>(&n->val), &val, sizeof(Val));
+    return off;
+  }
+
+  void link(std::atomic<uint64_t>* bkt, size_t bkt_num, uint64_t pre, uint64_t off) {
+    if (pre) {
+      node(pre)->next.store(off, std::memory_order_release);
+    } else {
+      bkt[bkt_num].store(off, std::memory_order_release);
+    }
+  }
+
+  uint64_t new_table(size_t nbucket) {
+    uint64_t off = allocate(sizeof(ShmTable) + nbucket * sizeof(std::atomic<uint64_t>));
+    if (!off) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " new_table no memory " << nbucket << std::endl;
+      return 0;
+    }
+    ShmTable* t = table(off);
+    t->nbucket = nbucket;
+    std::atomic<uint64_t>* bkt = slots(t);
+    for (size_t i = 0; i < nbucket; ++i) {
+      bkt[i].store(0, std::memory_order_relaxed);
+    }
+    return off;
+  }
+
+  void free_table(uint64_t off, size_t nbucket) {
+    std::atomic<uint64_t>* bkt = slots(table(off));
+    for (size_t i = 0; i < nbucket; ++i) {
+      for (uint64_t cur = bkt[i].load(std::memory_order_relaxed); cur; ) {
+        uint64_t next = node(cur)->next.load(std::memory_order_relaxed);
+        free_block(cur);
+        cur = next;
+      }
+    }
+    free_block(off);
+  }
+
+  ShmReaderSlot* claim_slot() const {
+    uint64_t pid = getpid();
+    for (size_t i = 0; i < kShmMaxReaders; ++i) {
+      ShmReaderSlot& slot = header_->readers[i];
+      uint64_t expect = 0;
+      if (slot.pid.compare_exchange_strong(expect, pid)) {
+        slot.epoch.store(0);
+        slot.owner.store(attach_token_);
+        return &slot;
+      }
+    }
+    return nullptr;
+  }
+
+  //当前线程在本次attach上的登记，第一次调用时分配slot。写进程返回nullptr
+  ShmThreadReader* thread_reader() const {
+    if (!reader_slot_) {
+      return nullptr;
+    }
+    std::deque<ShmThreadReader>& readers = shm_thread_readers().readers;
+    for (size_t i = 0; i < readers.size(); ++i) {
+      if (readers[i].token == attach_token_) {
+        return &readers[i];
+      }
+    }
+    ShmThreadReader r = {attach_token_, claim_slot(), 0};
+    readers.push_back(r);
+    return &readers.back();
+  }
+
+  void enter(ShmThreadReader* reader) const {
+    if (reader->slot) {
+      reader->slot->epoch.store(header_->global_epoch.load());
+      return;
+    }
+    //共享slot记录最早进入的线程的epoch，最后一个线程离开时清除
+    std::lock_guard<std::mutex> lock(shared_mutex_);
+    if (0 == shared_depth_++) {
+      reader_slot_->epoch.store(header_->global_epoch.load());
+    }
+  }
+
+  void leave(ShmThreadReader* reader) const {
+    if (reader->slot) {
+      reader->slot->epoch.store(0, std::memory_order_release);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(shared_mutex_);
+    if (0 == --shared_depth_) {
+      reader_slot_->epoch.store(0, std::memory_order_release);
+    }
+  }
+
+  ShmSegmentHeader* header_ {nullptr};
+  size_t header_len_ {0};
+  char* data_ {nullptr};
+  size_t data_len_ {0};        // 读进程单独映射的数据区长度
+  bool is_writer_ {false};
+  ShmReaderSlot* reader_slot_ {nullptr};    // 进程共享的slot，写进程为nullptr
+  uint64_t attach_token_ {0};
+  mutable std::mutex shared_mutex_;
+  mutable int shared_depth_ {0};
+  Equal equals_;
+  Hash hash_func_;
+  double max_load_factor_ {1.0};
+};
+
+}
+
+#endif
@@ -4,8 +4,20 @@
 #include <memory.h>
 #include <iterator>
 #include <new>
+#include <atomic>
 #include <functional>
 #include <iostream>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "delay_delete_allocator.hpp"
+#include "delay_delete_arena.hpp"
+#include "delay_delete_hash.hpp"
+#include "delay_delete_bloom_filter.hpp"
+#include "delay_delete_huge_page.hpp"
 
 namespace utils {
 
@@ -34,6 +46,86 @@ template <class Val>
 struct HashTableNode {
   HashTableNode* p_next; 
   Val* p_value;
+  size_t hash_code;    //缓存key的hash值，比较和rehash时不必访问p_value
+  std::atomic<uint32_t> hit_count;   //读线程采样的命中次数，写线程据此把热节点移到链头
+};
+
+//桶，value是链头节点的p_value，节点不可变，两项一起用一次16字节写发布。
+//查找先比较value中的key，命中链头时不访问节点，只访问桶和value两处内存；
+//不命中时才沿节点链比较。不存在的key由bloom filter过滤
+template <class Val>
+struct alignas(16) HashTableSlot {
+  HashTableNode<Val>* first;
+  Val* value;
+};
+
+//写线程修改链头，first和value一次写入。
+//支持AVX的x86处理器上对齐的16字节SSE读写是原子的，读线程不会读到新旧混合的两项
+template <class Val>
+inline void store_slot(HashTableSlot<Val>& slot, HashTableNode<Val>* first) {
+  HashTableSlot<Val> tmp;
+  tmp.first = first;
+  tmp.value = first ? first->p_value : nullptr;
+#if defined(__SSE2__)
+  _mm_store_si128(reinterpret_cast<__m128i*>(&slot), _mm_load_si128(reinterpret_cast<const __m128i*>(&tmp)));
+#else
+  slot = tmp;
+#endif
+}
+
+//读线程一次读出first和value。没有16字节读写时value从节点取，多访问一次节点
+template <class Val>
+inline HashTableSlot<Val> load_slot(const HashTableSlot<Val>& slot) {
+  HashTableSlot<Val> tmp;
+#if defined(__SSE2__)
+  _mm_store_si128(reinterpret_cast<__m128i*>(&tmp), _mm_load_si128(reinterpret_cast<const __m128i*>(&slot)));
+#else
+  tmp.first = slot.first;
+  tmp.value = tmp.first ? tmp.first->p_value : nullptr;
+#endif
+  return tmp;
+}
+
+//桶数组，slots是连续的桶，读线程查找时只访问一次桶。
+//version是桶数组发布时的代数，随迭代器和快照返回给读线程
+template <class Val>
+struct HashTableBuckets {
+  typedef HashTableSlot<Val> Slot;
+
+  Slot* slots {nullptr};
+  size_t version {0};
+
+  HashTableBuckets() {}
+  HashTableBuckets(std::nullptr_t) {}
+  explicit HashTableBuckets(Slot* s, size_t v = 0) : slots(s), version(v) {}
+
+  Slot& operator[] (size_t n) const {
+    return slots[n];
+  }
+  explicit operator bool() const noexcept {
+    return nullptr != slots;
+  }
+  bool operator== (const HashTableBuckets& other) const {
+    return slots == other.slots;
+  }
+  bool operator!= (const HashTableBuckets& other) const {
+    return slots != other.slots;
+  }
+};
+
+//写操作日志，设置后写线程在每次修改生效时回调，见DelayDeleteWal
+template <class Val>
+class DelayDeleteTableLog {
+ public:
+  virtual ~DelayDeleteTableLog() {}
+  virtual void log_put(const Val& obj) = 0;      // insert_unique插入或替换
+  virtual void log_append(const Val& obj) = 0;   // insert_equal插入
+  virtual void log_remove(const Val& obj) = 0;   // 删除一个元素
+  virtual void log_clear() {}                    // clear之前调用
+  virtual void log_batch_begin() {}              // write batch的记录之前调用
+  virtual void log_batch_end() {}                // write batch的记录之后调用
+  virtual int commit() { return 0; }             // 持久化已记录的修改
+  virtual int checkpoint() { return 0; }
 };
 
 template <typename Key, typename Val, typename Alloc, typename ExtractKey,
@@ -47,6 +139,8 @@ struct DelayDeleteHashtableIterator {
   typedef DelayDeleteHashtableIterator<Key, Val, Alloc, ExtractKey, Equal, Hash> iterator;
   typedef DelayDeleteHashtableIterator<Key, Val, Alloc, ExtractKey, Equal, Hash> const_iterator;
   typedef HashTableNode<Val> Node;
+  typedef HashTableSlot<Val> Slot;
+  typedef HashTableBuckets<Val> Buckets;
   typedef std::forward_iterator_tag iterator_category;
   typedef Val value_type;
   typedef ptrdiff_t difference_type;
@@ -54,33 +148,39 @@ struct DelayDeleteHashtableIterator {
   typedef Val& reference;
   typedef Val* pointer;
   Node* cur_ {nullptr};
-  Node** ht_ {nullptr};
+  pointer value_ {nullptr};   //cur_->p_value，链头命中时取自桶，不访问节点
+  Buckets ht_;
   size_type ht_sz_ {0};
-  ExtractKey extract_key_;
-  Hash hash_func_;
 
   DelayDeleteHashtableIterator() {}
-  DelayDeleteHashtableIterator(Node* n, Node** tab, size_type sz) :
-    cur_(n), ht_(tab), ht_sz_(sz) {
+  DelayDeleteHashtableIterator(Node* n, Buckets tab, size_type sz) :
+    cur_(n), value_(n ? n->p_value : nullptr), ht_(tab), ht_sz_(sz) {
+  }
+  DelayDeleteHashtableIterator(Node* n, pointer v, Buckets tab, size_type sz) :
+    cur_(n), value_(v), ht_(tab), ht_sz_(sz) {
   }
   DelayDeleteHashtableIterator(const DelayDeleteHashtableIterator& other) {
     cur_ = other.cur_;
+    value_ = other.value_;
     ht_ = other.ht_;
     ht_sz_ = other.ht_sz_;
   }
   DelayDeleteHashtableIterator(const DelayDeleteHashtableIterator&& other) {
     cur_ = other.cur_;
+    value_ = other.value_;
     ht_ = other.ht_;
     ht_sz_ = other.ht_sz_;
   }
   DelayDeleteHashtableIterator& operator = (const DelayDeleteHashtableIterator& other) {
     cur_ = other.cur_;
+    value_ = other.value_;
     ht_ = other.ht_;
     ht_sz_ = other.ht_sz_;
     return *this;
   }
   DelayDeleteHashtableIterator& operator = (const DelayDeleteHashtableIterator&& other) {
     cur_ = other.cur_;
+    value_ = other.value_;
     ht_ = other.ht_;
     ht_sz_ = other.ht_sz_;
     return *this;
@@ -89,8 +189,10 @@ struct DelayDeleteHashtableIterator {
   explicit operator bool() const noexcept {
     return nullptr != cur_;
   }
-  reference operator* () const { return *(cur_->p_value); }
-  pointer operator-> () const { return cur_->p_value; }
+  //迭代器所在桶数组的代数，与table的version()对应
+  size_type version() const { return ht_.version; }
+  reference operator* () const { return *value_; }
+  pointer operator-> () const { return value_; }
   bool operator== (const iterator& it) const {
     return cur_ == it.cur_ && ht_ == it.ht_ && ht_sz_ == it.ht_sz_;
   }
@@ -102,11 +204,12 @@ struct DelayDeleteHashtableIterator {
     const Node* old = cur_;
     cur_ = cur_->p_next;
     if (!cur_) {
-      size_type bucket_num = hash_func_(extract_key_(*old->p_value)) % ht_sz_;
+      size_type bucket_num = old->hash_code % ht_sz_;
       while (!cur_ && ++bucket_num < ht_sz_) {
-        cur_ = ht_[bucket_num];
+        cur_ = ht_[bucket_num].first;
       }
     }
+    value_ = cur_ ? cur_->p_value : nullptr;
     return *this;
   }
 
@@ -141,9 +244,12 @@ class DelayDeleteHashtable {
           Equal, Hash> const_iterator;
 
   typedef HashTableNode<Val> Node;
+  typedef HashTableSlot<Val> Slot;
+  typedef HashTableBuckets<Val> Buckets;
   typedef Alloc value_allocator;
   typedef DelayDeleteAllocator<Node> node_allocator;
-  
+  static const bool kHashIdentifiesKey = HashIdentifiesKey<Key, Hash, Equal>::value;
+
   DelayDeleteHashtable() {}
   DelayDeleteHashtable(const DelayDeleteHashtable& other) {
     make_copy(other);
@@ -163,6 +269,7 @@ class DelayDeleteHashtable {
   }
   void make_copy(const DelayDeleteHashtable& other) {
     max_load_factor_ = other.max_load_factor_;
+    bloom_bits_per_item_ = other.bloom_bits_per_item_;
     n_item_ = other.n_item_;
     init(n_item_);
     size_type other_current = other.current_;
@@ -176,11 +283,19 @@ class DelayDeleteHashtable {
     nbucket_[1] = other.nbucket_[1];
     bucket_[0] = other.bucket_[0];
     bucket_[1] = other.bucket_[1];
-    current_ = other.current_;
+    bloom_[0].store(other.bloom_[0].load());
+    bloom_[1].store(other.bloom_[1].load());
+    shared_nodes_[0] = other.shared_nodes_[0];
+    shared_nodes_[1] = other.shared_nodes_[1];
+    version_.store(other.version_.load());
+    bloom_bits_per_item_ = other.bloom_bits_per_item_;
+    current_.store(other.current_.load());
     resize_count_ = other.resize_count_;
     other.n_item_ = 0;
     other.bucket_[0] = nullptr; 
     other.bucket_[1] = nullptr; 
+    other.bloom_[0] = nullptr;
+    other.bloom_[1] = nullptr;
     other.nbucket_[0] = 0;
     other.nbucket_[1] = 0;
     other.resize_count_ = 0;
@@ -192,18 +307,174 @@ class DelayDeleteHashtable {
 
   int init(size_t n) {
     size_t nbucket = find_near_prime(n);  
-    Node** bkt = new_bucket(nbucket);
+    Buckets bkt = new_bucket(nbucket);
     if (!bkt) {
       std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__<< "init no memory " << nbucket << std::endl;
       return -1;
     }
     bucket_[current_] = bkt;
     nbucket_[current_] = nbucket;
+    if (bloom_bits_per_item_ && !bloom_[current_]) {
+      bloom_[current_] = new_bloom(bkt, nbucket);
+    }
+    return 0;
+  }
+
+  //增量compact：从上次的位置开始，把不超过budget个节点及其value按桶顺序
+  //复制到一块新的连续arena中。每个桶的新链完整建好后替换slot发布，
+  //旧节点和value经allocator延迟删除。返回true表示已经完成一整轮
+  bool compact(size_type budget) {
+    Buckets bkt = bucket_[current_];
+    size_type sz = nbucket_[current_];
+    if (compact_pos_ >= sz) {
+      compact_pos_ = 0;
+    }
+    size_type begin = compact_pos_;
+    size_type end = begin;
+    size_type n = 0;
+    for (; end < sz; ++end) {
+      size_type cnt = bucket_size(end, bkt, sz);
+      if (n && n + cnt > budget) {
+        break;
+      }
+      n += cnt;
+    }
+    compact_pos_ = end;
+    if (0 == n) {
+      return end >= sz;
+    }
+    //节点和value交替放置，一次链遍历只访问相邻内存
+    const size_type align = alignof(value_type) > alignof(Node) ? alignof(value_type) : alignof(Node);
+    const size_type node_sz = (sizeof(Node) + align - 1) / align * align;
+    const size_type stride = (node_sz + sizeof(value_type) + align - 1) / align * align;
+    char* base = static_cast<char*>(arena_.allocate_chunk(n * stride, 2 * n));
+    if (!base) {
+      compact_pos_ = begin;
+      return false;
+    }
+    node_alloc_.set_arena(&arena_);
+    value_alloc_.set_arena(&arena_);
+    for (size_type i = begin; i < end; ++i) {
+      Node* old_first = bkt[i].first;
+      if (!old_first) {
+        continue;
+      }
+      Node* new_first = nullptr;
+      Node* pre = nullptr;
+      for (Node* cur = old_first; cur; cur = cur->p_next) {
+        Node* tmp = reinterpret_cast<Node*>(base);
+        pointer v = reinterpret_cast<pointer>(base + node_sz);
+        base += stride;
+        value_alloc_.construct(v, *cur->p_value);
+        tmp->p_next = nullptr;
+        tmp->p_value = v;
+        tmp->hash_code = cur->hash_code;
+        tmp->hit_count.store(cur->hit_count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        if (pre) {
+          pre->p_next = tmp;
+        } else {
+          new_first = tmp;
+        }
+        pre = tmp;
+      }
+      //整条链一次替换
+      set_first(bkt, i, new_first);
+      delete_chain(old_first, nullptr, true);
+    }
+    return end >= sz;
+  }
+
+  //设置写操作日志，为nullptr时关闭。clear不记录日志
+  void set_log(DelayDeleteTableLog<Val>* log) {
+    log_ = log;
+  }
+
+  //开启命中采样，每sample_period次find记录一次命中，sample_period取2的幂，0表示关闭
+  void enable_hit_sampling(size_type sample_period = 64) {
+    size_type period = 1;
+    while (period < sample_period) {
+      period <<= 1;
+    }
+    hit_sample_period_ = sample_period ? period : 0;
+  }
+
+  //从上次的位置开始扫描max_bucket个桶，把命中次数最多的节点移到链头。
+  //移动时复制热节点和它之前的节点(共享value)，组成新的链头接到热节点之后的旧链上，
+  //一次替换slot发布，旧节点延迟删除。正在遍历旧链的读线程不会漏掉节点。
+  //扫描过的桶命中次数减半。返回移动的节点数
+  size_type reorder_hot_nodes(size_type max_bucket) {
+    Buckets bkt = bucket_[current_];
+    size_type sz = nbucket_[current_];
+    size_type moved = 0;
+    if (0 == sz) {
+      return moved;
+    }
+    for (size_type i = 0; i < max_bucket && i < sz; ++i) {
+      if (reorder_pos_ >= sz) {
+        reorder_pos_ = 0;
+      }
+      size_type n = reorder_pos_++;
+      Slot& slot = bkt[n];
+      Node* first = slot.first;
+      if (!first || !first->p_next) {
+        continue;
+      }
+      Node* hot_pre = nullptr;
+      Node* hot = first;
+      uint32_t hot_count = first->hit_count.load(std::memory_order_relaxed);
+      for (Node* pre = first, *cur = first->p_next; cur; pre = cur, cur = cur->p_next) {
+        uint32_t cnt = cur->hit_count.load(std::memory_order_relaxed);
+        if (cnt > hot_count) {
+          hot_pre = pre;
+          hot = cur;
+          hot_count = cnt;
+        }
+      }
+      if (hot_pre && !has_equal_key(first, hot)) {
+        Node* head = copy_node(hot);
+        Node* pre = head;
+        for (Node* cur = first; cur != hot; cur = cur->p_next) {
+          pre->p_next = copy_node(cur);
+          pre = pre->p_next;
+        }
+        pre->p_next = hot->p_next;
+        set_first(bkt, n, head);
+        for (Node* cur = first, *next = nullptr; cur != hot->p_next; cur = next) {
+          next = cur->p_next;
+          delete_node(cur);
+        }
+        ++moved;
+      }
+      for (Node* cur = slot.first; cur; cur = cur->p_next) {
+        cur->hit_count.store(cur->hit_count.load(std::memory_order_relaxed) >> 1, std::memory_order_relaxed);
+      }
+    }
+    return moved;
+  }
+
+  //开启bloom filter，find/count/equal_range先查filter，
+  //多数不存在的key只访问一条cache line。filter在resize时重建，
+  //上次重建后删除的元素超过当前元素数的rebuild_ratio倍时也重建，去掉已删除key的bit
+  int enable_bloom_filter(size_type bits_per_item = 10, double rebuild_ratio = 0.25) {
+    bloom_bits_per_item_ = bits_per_item;
+    bloom_rebuild_ratio_ = rebuild_ratio;
+    if (bucket_[current_] && !bloom_[current_]) {
+      BlockedBloomFilter* bloom = new_bloom(bucket_[current_], nbucket_[current_]);
+      if (!bloom) {
+        return -1;
+      }
+      bloom_[current_].store(bloom, std::memory_order_release);
+    }
     return 0;
   }
   size_type resize_count() const {
     return resize_count_;
   }
+  //当前桶数组的代数，每次切换桶数组(resize或者提交write batch)加一。
+  //读线程应使用find返回的迭代器或快照的version()，它们与读到的桶数组一致
+  size_type version() const {
+    return bucket_[current_.load(std::memory_order_acquire)].version;
+  }
   size_type size() const {
     return n_item_;
   }
@@ -214,12 +485,12 @@ class DelayDeleteHashtable {
     return bucket_size(n, bucket_[current_], nbucket_[current_]);
   }
 
-  size_type bucket_size(size_type n, Node** bkt, size_type bkt_sz) const { 
+  size_type bucket_size(size_type n, Buckets bkt, size_type bkt_sz) const { 
     size_type sz = 0;
     if (n >= bkt_sz) {
       return sz;
     }
-    Node* cur = bkt[n];
+    Node* cur = bkt[n].first;
     while (cur) {
       ++sz;
       cur = cur->p_next;
@@ -236,21 +507,34 @@ class DelayDeleteHashtable {
     if (0 == n) {
       return 0;
     }
-    return hash_func_(extract_key_(obj)) % n;
+    return hash_code(obj) % n;
+  }
+  size_type hash_code(const value_type& obj) {
+    return hash_func_(extract_key_(obj));
   }
 
-  Node* new_node(const value_type& obj) {
+  Node* new_node(const value_type& obj, size_type h) {
     Node* n = node_alloc_.allocate(1); 
     pointer v = value_alloc_.allocate(1);
     value_alloc_.construct(v, obj);
     n->p_next = nullptr;
     n->p_value = v;
+    n->hash_code = h;
+    n->hit_count.store(0, std::memory_order_relaxed);
+    BlockedBloomFilter* bloom = bloom_[current_].load(std::memory_order_relaxed);
+    if (bloom) {
+      //先写filter再发布节点
+      bloom->add(h);
+    }
     return n;
   }
-  Node* new_node(value_type* obj) {
+  Node* new_node(value_type* obj, size_type h) {
     Node* n = node_alloc_.allocate(1);
     n->p_next = nullptr;
     n->p_value = obj;
+    n->hash_code = h;
+    n->hit_count.store(0, std::memory_order_relaxed);
+    return n;
   }
 
   void delete_node(Node* n, bool with_value = false) {
@@ -261,9 +545,23 @@ class DelayDeleteHashtable {
   }
 
   void garbage_collect() {
-    delete_bucket(bucket_[1 - current_], nbucket_[1 - current_]);
-    bucket_[1 - current_] = nullptr;
-    nbucket_[1 - current_] = 0;
+    //有快照在读时不回收，等快照全部释放后的下一次garbage_collect再回收
+    if (snapshot_pins_.load(std::memory_order_seq_cst) > 0) {
+      return;
+    }
+    frozen_ = false;
+    int next = 1 - current_;
+    if (bucket_[next] && shared_nodes_[next] && nbucket_[next] == nbucket_[current_]) {
+      //换下的桶数组已经没有读线程，保留给下一次write batch同步后复用，它的filter作废
+      retire_bloom(next, nullptr);
+      mirror_ready_ = true;
+    } else {
+      release_bucket(next);
+    }
+    for (size_type i = 0; i < retired_.size(); ++i) {
+      delete_bucket(retired_[i]);
+    }
+    retired_.clear();
     value_alloc_.garbage_collect();
     node_alloc_.garbage_collect();
   }
@@ -275,7 +573,7 @@ class DelayDeleteHashtable {
     ++resize_count_;
     //获取下个大素数，并且切换buffer，重新hash。
     size_t nbucket = find_near_prime(nbucket_[current_] + 1);
-    Node** bkt = new_bucket(nbucket);
+    Buckets bkt = new_bucket(nbucket);
     if (!bkt) {
       //无内存空间
       std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__<< "delay_delete_table resize no memory" << std::endl;
@@ -283,32 +581,105 @@ class DelayDeleteHashtable {
     }
     //将current内元素拷入新桶内
     cp_bucket(bucket_[current_], nbucket_[current_], bkt, nbucket);
-    if (bucket_[1 - current_]) {
-      delete_bucket(bucket_[1 - current_], nbucket_[1 - current_]);
-      bucket_[1 - current_] = nullptr;
-      nbucket_[1 - current_] = 0;
-    }
-    bucket_[1 - current_] = bkt;
-    nbucket_[1 - current_] = nbucket;
-    //切换current
-    current_ = 1 - current_; 
+    //重建bloom filter，顺带清除已删除key的残留bit
+    BlockedBloomFilter* bloom = bloom_bits_per_item_ ? new_bloom(bkt, nbucket) : nullptr;
+    publish_bucket(bkt, nbucket, bloom, false);
     return;
   }
 
-  std::pair<iterator, bool> insert_unique(const value_type& obj, Node** bkt, size_type sz, bool is_replace) {
-    size_type bkt_num = bucket_num(obj, sz);
-    Node* bkt_first =  bkt[bkt_num];
+  //在新桶数组上执行batch中的操作，然后一次切换current_发布。
+  //不需要扩容时新桶数组与当前桶数组共享节点，只有被batch修改的链复制一份(写时复制)，
+  //旧链在提交后延迟删除。上次切换后garbage_collect过时复用换下的桶数组，
+  //只同步之后修改过的桶；否则复制整个桶数组。读线程始终访问连续的桶数组。
+  //is_unique 为true时insert按insert_unique(替换)执行，否则按insert_equal执行
+  template <class Batch>
+  int write_batch(const Batch& batch, bool is_unique) {
+    if (batch.empty()) {
+      return 0;
+    }
+    //batch不修改当前桶数组，已经登记的快照不需要另外复制
+    WriteScope scope(this, false);
+    frozen_seq_ = snapshot_seq_.load(std::memory_order_seq_cst);
+    Buckets old_bkt = bucket_[current_];
+    size_type old_sz = nbucket_[current_];
+    //整个batch只检查一次是否需要扩容
+    size_type nbucket = old_sz;
+    size_type n_need = (n_item_ + batch.insert_count()) / max_load_factor_;
+    if (0 == nbucket || n_need > nbucket) {
+      nbucket = find_near_prime(n_need > nbucket ? n_need : nbucket + 1);
+    }
+    bool is_shared = nbucket == old_sz;
+    Buckets bkt = is_shared ? mirror_bucket() : new_bucket(nbucket);
+    if (!bkt) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__<< "delay_delete_table write_batch no memory" << std::endl;
+      return -1;
+    }
+    if (!is_shared) {
+      ++resize_count_;
+      cp_bucket(old_bkt, old_sz, bkt, nbucket);
+    }
+    typedef typename Batch::Op Op;
+    std::vector<Node*> old_chains;
+    if (log_) {
+      log_->log_batch_begin();
+    }
+    for (const Op& op : batch.ops()) {
+      if (is_shared) {
+        size_type h = Batch::kInsert == op.type ? hash_code(batch.value(op)) : hash_func_(batch.key(op));
+        copy_on_write(bkt, old_bkt, h % nbucket, &old_chains);
+      }
+      if (Batch::kInsert == op.type) {
+        const value_type& obj = batch.value(op);
+        if (is_unique) {
+          insert_unique(obj, bkt, nbucket, true);
+        } else {
+          insert_equal(obj, bkt, nbucket);
+        }
+      } else {
+        erase(batch.key(op), bkt, nbucket);
+      }
+    }
+    if (log_) {
+      log_->log_batch_end();
+    }
+    //new_node已经把新key加入了旧filter，拷贝一份给新桶数组
+    BlockedBloomFilter* bloom = nullptr;
+    if (bloom_bits_per_item_) {
+      bloom = is_shared && bloom_[current_] && !bloom_stale() ?
+          clone_bloom(*bloom_[current_]) : new_bloom(bkt, nbucket);
+    }
+    publish_bucket(bkt, nbucket, bloom, is_shared);
+    //旧桶数组中被复制过的链只属于旧桶数组，提交后删除
+    for (size_type i = 0; i < old_chains.size(); ++i) {
+      delete_chain(old_chains[i], nullptr);
+    }
+    return 0;
+  }
+
+  //replaced不为空时记录被替换的value，它在下次garbage_collect前有效
+  std::pair<iterator, bool> insert_unique(const value_type& obj, Buckets bkt, size_type sz, bool is_replace,
+                                          const_pointer* replaced = nullptr) {
+    size_type h = hash_code(obj);
+    size_type bkt_num = h % sz;
+    cow_chain(bkt, bkt_num);
+    Node* bkt_first = bkt[bkt_num].first;
     for (Node* pre = nullptr, * cur = bkt_first; cur; pre = cur, cur = cur->p_next) {
-      if (equals_(extract_key_(obj), extract_key_(*cur->p_value))) {
+      if (node_equals(extract_key_(obj), h, cur)) {
         if (is_replace) {
-          Node* tmp = new_node(obj);
+          Node* tmp = new_node(obj, h);
           tmp->p_next = cur->p_next;
           if (pre) {
             pre->p_next = tmp;
           } else {
-            bkt[bkt_num] = tmp;
+            set_first(bkt, bkt_num, tmp);
+          }
+          if (replaced) {
+            *replaced = cur->p_value;
           }
           delete_node(cur, true);
+          if (log_) {
+            log_->log_put(obj);
+          }
           return std::pair<iterator, bool> (iterator(tmp, bkt, sz), true);
         } else {
           return std::pair<iterator, bool> (iterator(cur, bkt, sz), false);
@@ -316,45 +687,70 @@ class DelayDeleteHashtable {
       }
     }
     //创建新节点,插入头部
-    Node* tmp = new_node(obj);
-    tmp->p_next = bkt_first;
-    bkt[bkt_num] = tmp;
+    Node* tmp = new_node(obj, h);
+    tmp->p_next = bkt[bkt_num].first;
+    set_first(bkt, bkt_num, tmp);
     ++n_item_;
+    if (log_) {
+      log_->log_put(obj);
+    }
     return std::pair<iterator, bool> (iterator(tmp, bkt, sz), true);
   }
 
   std::pair<iterator, bool> insert_unique(const value_type& obj, bool is_resize = true, bool is_replace = false) {
+    WriteScope scope(this);
     if (is_resize) {
       resize(); 
     }
     return insert_unique(obj, bucket_[current_], nbucket_[current_], is_replace);
   }
 
-  iterator insert_equal(const value_type& obj, Node** bkt, size_type sz) {
-    size_type bkt_num = bucket_num(obj, sz);
-    Node* bkt_first = bkt[bkt_num];
+  //插入或替换，只遍历一次链。key已存在时返回被替换的value，
+  //它在下次garbage_collect前有效；新插入时返回nullptr
+  const_pointer replace_unique(const value_type& obj, bool is_resize = true) {
+    WriteScope scope(this);
+    if (is_resize) {
+      resize();
+    }
+    const_pointer replaced = nullptr;
+    insert_unique(obj, bucket_[current_], nbucket_[current_], true, &replaced);
+    return replaced;
+  }
+
+  iterator insert_equal(const value_type& obj, Buckets bkt, size_type sz) {
+    size_type h = hash_code(obj);
+    size_type bkt_num = h % sz;
+    cow_chain(bkt, bkt_num);
+    Node* bkt_first = bkt[bkt_num].first;
     for (Node *pre = nullptr, *cur = bkt_first; cur; pre = cur, cur = cur->p_next) {
-      if (equals_(extract_key_(obj), extract_key_(*cur->p_value))) {
-        Node* tmp = new_node(obj);
+      if (node_equals(extract_key_(obj), h, cur)) {
+        Node* tmp = new_node(obj, h);
         tmp->p_next = cur;
         if (pre) {
           pre->p_next = tmp;
         } else {
-          bkt[bkt_num] = tmp;
+          set_first(bkt, bkt_num, tmp);
         }
         ++n_item_;
+        if (log_) {
+          log_->log_append(obj);
+        }
         return iterator(tmp, bkt, sz);
       }
     }
     //没有找到相等节点，插入链表头部
-    Node* tmp = new_node(obj);
+    Node* tmp = new_node(obj, h);
     tmp->p_next = bkt_first;
-    bkt[bkt_num] = tmp;
+    set_first(bkt, bkt_num, tmp);
     ++n_item_;
+    if (log_) {
+      log_->log_append(obj);
+    }
     return iterator(tmp, bkt, sz);
   }
 
   iterator insert_equal(const value_type& obj, bool is_resize = true) {
+    WriteScope scope(this);
     if (is_resize) {
       resize();
     }
@@ -365,24 +761,30 @@ class DelayDeleteHashtable {
   // 查找 < obj < 位置,进行插入
   iterator insert_equal_with_value_cmp(const value_type& obj,
                                        value_cmp cmp,
-                                       Node** bkt,
+                                       Buckets bkt,
                                        size_type sz,
                                        bool is_replace) {
     //插入equal头部
-    size_type bkt_num = bucket_num(obj, sz);
-    Node* bkt_first = bkt[bkt_num];
+    size_type h = hash_code(obj);
+    size_type bkt_num = h % sz;
+    cow_chain(bkt, bkt_num);
+    Node* bkt_first = bkt[bkt_num].first;
     for (Node *pre = nullptr, *cur = bkt_first; cur; pre = cur, cur = cur->p_next) {
-      if (equals_(extract_key_(obj), extract_key_(*cur->p_value))) {
-        for (; cur && equals_(extract_key_(obj), extract_key_(*cur->p_value));  pre = cur, cur = cur->p_next) {
+      if (node_equals(extract_key_(obj), h, cur)) {
+        for (; cur && node_equals(extract_key_(obj), h, cur);  pre = cur, cur = cur->p_next) {
           int cmp_res = cmp(obj, *cur->p_value);
           if (0 == cmp_res) {
             if (is_replace) {
-              Node* tmp = new_node(obj);
+              Node* tmp = new_node(obj, h);
               tmp->p_next = cur->p_next;
               if (pre) {
                 pre->p_next = tmp;
               } else {
-                bkt[bkt_num] = tmp;
+                set_first(bkt, bkt_num, tmp);
+              }
+              if (log_) {
+                log_->log_remove(*cur->p_value);
+                log_->log_append(obj);
               }
               delete_node(cur, true);
               return iterator(tmp, bkt, sz);
@@ -390,30 +792,39 @@ class DelayDeleteHashtable {
               return end();
             }
           } else if (cmp_res < 0) {
-            Node* tmp = new_node(obj);
+            Node* tmp = new_node(obj, h);
             tmp->p_next = cur;
             if (pre) {
               pre->p_next = tmp;
             } else {
-              bkt[bkt_num] = tmp;
+              set_first(bkt, bkt_num, tmp);
             }
             ++n_item_;
+            if (log_) {
+              log_->log_append(obj);
+            }
             return iterator(tmp, bkt, sz);
           }
         }
         //没有找到< 或者 = ,一定 > 插入尾部
-        Node* tmp = new_node(obj);
+        Node* tmp = new_node(obj, h);
         ++n_item_;
         tmp->p_next = pre->p_next;
         pre->p_next = tmp;
+        if (log_) {
+          log_->log_append(obj);
+        }
         return iterator(tmp, bkt, sz);
       }
     }
     //没有找到相等节点，插入链表头部
-    Node* tmp = new_node(obj);
+    Node* tmp = new_node(obj, h);
     tmp->p_next = bkt_first;
-    bkt[bkt_num] = tmp;
+    set_first(bkt, bkt_num, tmp);
     ++n_item_;
+    if (log_) {
+      log_->log_append(obj);
+    }
     return iterator(tmp, bkt, sz);
   }
 
@@ -421,6 +832,7 @@ class DelayDeleteHashtable {
                                        value_cmp cmp,
                                        bool is_resize = true,
                                        bool is_replace = false) {
+    WriteScope scope(this);
     if (is_resize) {
       resize();
     }
@@ -433,44 +845,81 @@ class DelayDeleteHashtable {
 
   void clear() {
     int current = current_;
-    delete_bucket(bucket_[current], nbucket_[current], true);
-    bucket_[current] = nullptr;
-    nbucket_[current] = 0;
-    delete_bucket(bucket_[1 - current], nbucket_[1 - current]);
-    bucket_[1 - current] = nullptr;
-    nbucket_[1 - current] = 0;
+    release_bucket(current, true);
+    release_bucket(1 - current);
     garbage_collect();
     n_item_ = 0;
   }
 
 
-  iterator find(const key_type& key, Node** bkt, size_type sz) {
-    size_type bkt_num = hash_func_(key)% sz;
-    Node* cur = bkt[bkt_num];
-    while (cur) {
-      if (equals_(key, extract_key_(*cur->p_value))) {
+  template <class K>
+  iterator find(const K& key, Buckets bkt, size_type sz,
+               const BlockedBloomFilter* bloom = nullptr) {
+    size_type h = hash_func_(key);
+    if (bloom && !bloom->may_contain(h)) {
+      return end();
+    }
+    Slot slot = load_slot(bkt[h % sz]);
+    if (!slot.first) {
+      return end();
+    }
+    //先比较链头value中的key，命中时不访问节点
+    if (equals_(key, extract_key_(*slot.value))) {
+      if (hit_sample_period_) {
+        record_hit(slot.first);
+      }
+      return iterator(slot.first, slot.value, bkt, sz);
+    }
+    for (Node* cur = slot.first->p_next; cur; cur = cur->p_next) {
+      if (node_equals(key, h, cur)) {
+        if (hit_sample_period_) {
+          record_hit(cur);
+        }
         return iterator(cur, bkt, sz);
       }
-      cur = cur->p_next;
     }
     return end();
   }
 
-  iterator find(const key_type& key) {
+  template <class K>
+  iterator find(const K& key) {
     int current = current_;
-    return find(key, bucket_[current], nbucket_[current]); 
+    return find(key, bucket_[current], nbucket_[current], bloom_[current]);
   }
-  std::pair<iterator, iterator> equal_range(const key_type& key,
-                                            Node** bkt, size_type sz) {
-    size_type bkt_num = hash_func_(key)% sz; 
-    Node* cur = bkt[bkt_num];
+
+  //预取key所在桶，批量查找时先对一组key调用，再逐个find
+  template <class K>
+  void prefetch(const K& key) const {
+    int current = current_;
+    if (nbucket_[current]) {
+      __builtin_prefetch(&bucket_[current][hash_func_(key) % nbucket_[current]]);
+    }
+  }
+
+  //预取key所在链头的value，在prefetch之后、桶已经进入cache时调用
+  template <class K>
+  void prefetch_chain(const K& key) const {
+    int current = current_;
+    if (nbucket_[current]) {
+      Slot slot = load_slot(bucket_[current][hash_func_(key) % nbucket_[current]]);
+      if (slot.value) {
+        __builtin_prefetch(slot.value);
+      }
+    }
+  }
+  template <class K>
+  std::pair<iterator, iterator> equal_range(const K& key,
+                                            Buckets bkt, size_type sz,
+                                            const BlockedBloomFilter* bloom = nullptr) {
+    size_type h = hash_func_(key);
+    Node* cur = bloom && !bloom->may_contain(h) ? nullptr : bkt[h % sz].first;
     Node* p_first = nullptr;
     Node* p_end = nullptr;
     while (cur) {
-      if (equals_(key, extract_key_(*cur->p_value))) {
+      if (node_equals(key, h, cur)) {
         p_first = cur;
         while (cur) {
-          if (!equals_(key, extract_key_(*cur->p_value))) {
+          if (!node_equals(key, h, cur)) {
             p_end = cur;
             break;
           }
@@ -483,60 +932,78 @@ class DelayDeleteHashtable {
     return std::pair<iterator, iterator> (iterator(p_first, bkt, sz), iterator(p_end, bkt, sz));
   }
 
-  std::pair<iterator, iterator> equal_range(const key_type& key) {
+  template <class K>
+  std::pair<iterator, iterator> equal_range(const K& key) {
     int current = current_;
-    return equal_range(key, bucket_[current], nbucket_[current]);
+    return equal_range(key, bucket_[current], nbucket_[current], bloom_[current]);
   }
   
-  size_type count(const key_type& key, Node** bkt, size_type sz) {
-    size_type bkt_num = hash_func_(key)% sz; 
-    Node* cur = bkt[bkt_num];
+  template <class K>
+  size_type count(const K& key, Buckets bkt, size_type sz,
+                  const BlockedBloomFilter* bloom = nullptr) {
+    size_type h = hash_func_(key);
+    if (bloom && !bloom->may_contain(h)) {
+      return 0;
+    }
+    Node* cur = bkt[h % sz].first;
     size_type cnt = 0;
     while(cur) {
-      if (equals_(key, extract_key_(*cur->p_value))) {
+      if (node_equals(key, h, cur)) {
         ++cnt;
       }
       cur = cur->p_next;
     }
     return cnt;
   }
-  size_type count(const key_type& key) {
+  template <class K>
+  size_type count(const K& key) {
     int current = current_;
-    return count(key, bucket_[current], nbucket_[current]);
+    return count(key, bucket_[current], nbucket_[current], bloom_[current]);
   }
 
-  void erase(const key_type& key, Node** bkt, size_type sz) {
-    size_type bkt_num = hash_func_(key)% sz; 
-    Node* bkt_first =  bkt[bkt_num];
+  template <class K>
+  void erase(const K& key, Buckets bkt, size_type sz) {
+    size_type h = hash_func_(key);
+    size_type bkt_num = h % sz;
+    cow_chain(bkt, bkt_num);
+    Node* bkt_first = bkt[bkt_num].first;
     for (Node* pre = nullptr, * cur = bkt_first; cur; pre = cur, cur = cur->p_next) {
-      if (equals_(key, extract_key_(*cur->p_value))) {
+      if (node_equals(key, h, cur)) {
         if (pre) {
           pre->p_next = cur->p_next;
         } else {
-          bkt[bkt_num] = cur->p_next;
+          set_first(bkt, bkt_num, cur->p_next);
+        }
+        if (log_) {
+          log_->log_remove(*cur->p_value);
         }
         delete_node(cur, true);
-         --n_item_;
+        --n_item_;
+        ++n_erased_;
         return;
       }
     }
     return;
   }
 
-  void erase(const key_type& key) {
-    return erase(key, bucket_[current_], nbucket_[current_]);
+  template <class K>
+  void erase(const K& key) {
+    WriteScope scope(this);
+    erase(key, bucket_[current_], nbucket_[current_]);
+    maybe_rebuild_bloom();
   }
 
-  void erase(const_iterator first, const_iterator last, Node** bkt, size_type sz) {
+  void erase(const_iterator first, const_iterator last, Buckets bkt, size_type sz) {
     size_type bkt_num = bucket_num(*first, sz);
-    size_type last_bkt_num = last == end() ? sz : bucket_num(*last, sz);
+    size_type last_bkt_num = !last ? sz : bucket_num(*last, sz);
     if (bkt_num > last_bkt_num) {
       std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ <<" last before first" << std::endl;
       return;
     }
-    Node* first_node = first.cur;
-    Node* last_node = last.cur;
-    Node* cur = bkt[bkt_num];
+    Node* first_node = first.cur_;
+    Node* last_node = last.cur_;
+    cow_chain(bkt, bkt_num, &first_node, bkt_num == last_bkt_num ? &last_node : nullptr);
+    Node* cur = bkt[bkt_num].first;
     Node* pre_cur = nullptr;
     Node* pre_first = nullptr;
     Node* p_first = nullptr;
@@ -553,75 +1020,138 @@ class DelayDeleteHashtable {
       if (pre_first) {
         pre_first->p_next = last_node;
       } else {
-        bkt[bkt_num] = last_node;
+        set_first(bkt, bkt_num, last_node);
       }
-      n_item_ -= delete_chain(p_first, last_node, true);
+      n_item_ -= remove_chain(p_first, last_node);
       return;
     }
 
     if (pre_first) {
       pre_first->p_next = nullptr;
     } else {
-      bkt[bkt_num] = nullptr;
+      set_first(bkt, bkt_num, nullptr);
     }
-    n_item_ -= delete_chain(p_first, nullptr, true);
+    n_item_ -= remove_chain(p_first, nullptr);
 
     for (size_type i = bkt_num + 1; i < last_bkt_num; ++i) {
-      Node* tmp = bkt[i];
-      bkt[i] = nullptr;
-      n_item_ -= delete_chain(tmp, nullptr, true);
+      Node* tmp = bkt[i].first;
+      set_first(bkt, i, nullptr);
+      n_item_ -= remove_chain(tmp, nullptr);
     }
     if (last_bkt_num == sz) {
       return;
     }
-    cur = bkt[last_bkt_num];
+    cur = bkt[last_bkt_num].first;
     if (cur == last_node) {
       return;
     }
-    bkt[last_bkt_num] = last_node;
-    n_item_ -= delete_chain(cur, last_node, true);
+    set_first(bkt, last_bkt_num, last_node);
+    n_item_ -= remove_chain(cur, last_node);
     return; 
   }
 
   void erase(const_iterator first, const_iterator last) {
-    return erase(first, last, bucket_[current_], nbucket_[current_]);
+    WriteScope scope(this);
+    erase(first, last, bucket_[current_], nbucket_[current_]);
+    maybe_rebuild_bloom();
   }
   void erase(const_iterator position) {
     const_iterator end = position;
     ++end;
-    return erase(position, ++end, bucket_[current_], nbucket_[current_]);
+    WriteScope scope(this);
+    erase(position, end, bucket_[current_], nbucket_[current_]);
+    maybe_rebuild_bloom();
   }
 
-  void erase(const key_type& key, value_equal value_equal_fun, Node** bkt, size_type sz) {
-    size_type bkt_num = hash_func_(key)% sz; 
-    Node* bkt_first = bkt[bkt_num];
+  template <class K>
+  void erase(const K& key, value_equal value_equal_fun, Buckets bkt, size_type sz) {
+    size_type h = hash_func_(key);
+    size_type bkt_num = h % sz;
+    cow_chain(bkt, bkt_num);
+    Node* bkt_first = bkt[bkt_num].first;
     for (Node* pre = nullptr, * cur = bkt_first; cur; pre = cur, cur = cur->p_next) {
-      if (equals_(key, extract_key_(*cur->p_value)) && 
+      if (node_equals(key, h, cur) && 
           value_equal_fun(*cur->p_value)) {
         if (pre) {
           pre->p_next = cur->p_next;
         } else {
-          bkt[bkt_num] = cur->p_next;
+          set_first(bkt, bkt_num, cur->p_next);
+        }
+        if (log_) {
+          log_->log_remove(*cur->p_value);
         }
         delete_node(cur, true);
         --n_item_;
+        ++n_erased_;
         return;
       }
     }
     return;
   }
 
-  void erase(const key_type& key, value_equal value_equal_fun) {
-    return erase(key, value_equal_fun, bucket_[current_], nbucket_[current_]);
+  template <class K>
+  void erase(const K& key, value_equal value_equal_fun) {
+    WriteScope scope(this);
+    erase(key, value_equal_fun, bucket_[current_], nbucket_[current_]);
+    maybe_rebuild_bloom();
+  }
+
+  //扫描一遍所有桶，摘除pred返回true的元素，摘除的节点和value一次交给allocator。
+  //n_thread > 1 时按桶范围并行扫描，每个线程只修改自己范围内的桶，pred需要线程安全。
+  //返回删除的元素个数
+  template <class Pred>
+  size_type erase_if(Pred pred, size_type n_thread = 1) {
+    WriteScope scope(this);
+    Buckets bkt = bucket_[current_];
+    size_type sz = nbucket_[current_];
+    if (n_thread > sz) {
+      n_thread = sz;
+    }
+    //需要复制链时只能在写线程分配节点
+    if (frozen_) {
+      n_thread = 1;
+    }
+    //扫描时不逐个记录修改过的桶，下一次write batch整体同步
+    dirty_all_ = true;
+    if (n_thread <= 1) {
+      std::vector<Node*> removed;
+      sweep_bucket(pred, bkt, 0, sz, &removed);
+      size_type cnt = retire_nodes(removed);
+      maybe_rebuild_bloom();
+      return cnt;
+    }
+    std::vector<std::vector<Node*> > removed(n_thread);
+    std::vector<std::thread> workers;
+    size_type step = (sz + n_thread - 1) / n_thread;
+    for (size_type i = 0; i < n_thread; ++i) {
+      size_type begin = i * step;
+      size_type end = begin + step < sz ? begin + step : sz;
+      workers.push_back(std::thread([this, &pred, bkt, begin, end, &removed, i]() {
+        sweep_bucket(pred, bkt, begin, end, &removed[i]);
+      }));
+    }
+    size_type cnt = 0;
+    for (size_type i = 0; i < n_thread; ++i) {
+      workers[i].join();
+      cnt += retire_nodes(removed[i]);
+    }
+    maybe_rebuild_bloom();
+    return cnt;
+  }
+
+  //只保留pred返回true的元素
+  template <class Pred>
+  size_type retain(Pred pred, size_type n_thread = 1) {
+    return erase_if([&pred](const value_type& v) { return !pred(v); }, n_thread);
   }
   
   iterator begin() { 
     int current = current_;
-    Node** bkt = bucket_[current];
+    Buckets bkt = bucket_[current];
     size_type bkt_sz = nbucket_[current];
     for (size_type idx = 0; idx < bkt_sz; ++idx) {
-      if (bkt[idx]) {
-        return iterator(bkt[idx], bkt, bkt_sz);
+      if (bkt[idx].first) {
+        return iterator(bkt[idx].first, bkt, bkt_sz);
       }
     } 
     return  iterator(nullptr, bkt, bkt_sz);
@@ -633,11 +1163,11 @@ class DelayDeleteHashtable {
 
   const_iterator begin() const {
     int current = current_;
-    Node** bkt = bucket_[current];
+    Buckets bkt = bucket_[current];
     size_type bkt_sz = nbucket_[current];
     for (size_type idx = 0; idx < bkt_sz; ++idx) {
-      if (bkt[idx]) {
-        return iterator(bkt[idx], bkt, bkt_sz);
+      if (bkt[idx].first) {
+        return iterator(bkt[idx].first, bkt, bkt_sz);
       }
     } 
     return  iterator(nullptr, bkt, bkt_sz);
@@ -647,14 +1177,95 @@ class DelayDeleteHashtable {
     int current = current_;
     return iterator(nullptr, bucket_[current], nbucket_[current]);
   }
+
+  //全表遍历用的快照，固定创建时的桶数组，遍历结果是创建时刻的内容。
+  //写线程在快照之后的第一次写先发布一份复制的桶数组，之后修改与快照共享的链前先复制，
+  //快照的桶数组和链不再被修改；write batch和resize本来就不修改当前桶数组。
+  //快照存活期间garbage_collect不回收任何桶数组、节点和value，内存只增不减，应尽快释放
+  class Snapshot {
+   public:
+    Snapshot(Snapshot&& other) : pins_(other.pins_), bkt_(other.bkt_), nbucket_(other.nbucket_) {
+      other.pins_ = nullptr;
+    }
+    ~Snapshot() {
+      if (pins_) {
+        pins_->fetch_sub(1, std::memory_order_release);
+      }
+    }
+
+    iterator begin() const {
+      for (size_type idx = 0; idx < nbucket_; ++idx) {
+        if (bkt_[idx].first) {
+          return iterator(bkt_[idx].first, bkt_, nbucket_);
+        }
+      }
+      return iterator(nullptr, bkt_, nbucket_);
+    }
+    iterator end() const {
+      return iterator(nullptr, bkt_, nbucket_);
+    }
+    size_type bucket_count() const { return nbucket_; }
+    //快照固定的桶数组的代数
+    size_type version() const { return bkt_.version; }
+
+   private:
+    friend class DelayDeleteHashtable;
+    Snapshot(std::atomic<int>* pins, Buckets bkt, size_type nbucket)
+        : pins_(pins), bkt_(bkt), nbucket_(nbucket) {}
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator = (const Snapshot&) = delete;
+
+    std::atomic<int>* pins_;
+    Buckets bkt_;
+    size_type nbucket_;
+  };
+
+  //读线程调用。先登记快照再读取current_，
+  //写线程在登记之后的释放都会推迟到快照析构之后。
+  //增加snapshot_seq_后，只在写线程不在写操作中时读取current_，
+  //之后开始的写操作都会看到snapshot_seq_的变化，先固定这个桶数组再修改
+  Snapshot snapshot() {
+    snapshot_pins_.fetch_add(1, std::memory_order_seq_cst);
+    while (true) {
+      snapshot_seq_.fetch_add(1, std::memory_order_seq_cst);
+      size_type seq = write_seq_.load(std::memory_order_seq_cst);
+      if (seq & 1) {
+        std::this_thread::yield();
+        continue;
+      }
+      int current = current_.load(std::memory_order_seq_cst);
+      if (write_seq_.load(std::memory_order_seq_cst) == seq) {
+        return Snapshot(&snapshot_pins_, bucket_[current], nbucket_[current]);
+      }
+    }
+  }
+
  private:
-  inline void insert_value_to_bucket(value_type* p_node, Node** bkt, size_type bkt_sz) {
+  struct RetiredBucket {
+    Buckets bkt;
+    size_type nbucket;
+    bool is_shared;        //为true时节点属于后一个桶数组
+    BlockedBloomFilter* bloom;
+    bool with_value;
+  };
+
+  template <class K>
+  inline bool node_equals(const K& key, size_type h, const Node* n) {
+    //先比较缓存的hash值，hash能唯一确定key时不再访问p_value
+    if (n->hash_code != h) {
+      return false;
+    }
+    return (kHashIdentifiesKey && std::is_same<K, key_type>::value) ||
+        equals_(key, extract_key_(*n->p_value));
+  }
+
+  inline void insert_value_to_bucket(const Node* src, Buckets bkt, size_type bkt_sz) {
     //cp_bucket时使用,尾部插入。保证原来单链表顺序
-    Node* tmp = new_node(p_node);
-    size_type bkt_num = bucket_num(*p_node, bkt_sz);
-    Node* cur = bkt[bkt_num];
+    Node* tmp = new_node(src->p_value, src->hash_code);
+    size_type bkt_num = src->hash_code % bkt_sz;
+    Node* cur = bkt[bkt_num].first;
     if (nullptr == cur) {
-      bkt[bkt_num] = tmp;
+      store_slot(bkt[bkt_num], tmp);
       return;
     }
     while (cur->p_next) {
@@ -664,26 +1275,26 @@ class DelayDeleteHashtable {
     return;
   }
 
-  inline void cp_bucket(Node** sbkt, size_type sbkt_sz, Node** dbkt, size_type dbkt_sz) {
+  inline void cp_bucket(Buckets sbkt, size_type sbkt_sz, Buckets dbkt, size_type dbkt_sz) {
     //在rehash时使用，将一个同中节点，复制到另外一个桶内
-    if (nullptr == sbkt || nullptr == dbkt) {
+    if (!sbkt || !dbkt) {
       return;
     }
     for (size_type i = 0; i < sbkt_sz; ++i) {
-      Node* cur = sbkt[i];
+      Node* cur = sbkt[i].first;
       while (cur) {
-        insert_value_to_bucket(cur->p_value, dbkt, dbkt_sz);
+        insert_value_to_bucket(cur, dbkt, dbkt_sz);
         cur = cur->p_next;
       }
     }
   }
   
-  inline void deep_insert_value_to_bucket(value_type* p_node, Node** bkt, size_type bkt_sz) {
-    Node* tmp = new_node(*p_node);
-    size_type bkt_num = bucket_num(*p_node, bkt_sz);
-    Node* cur = bkt[bkt_num];
+  inline void deep_insert_value_to_bucket(const Node* src, Buckets bkt, size_type bkt_sz) {
+    Node* tmp = new_node(*src->p_value, src->hash_code);
+    size_type bkt_num = src->hash_code % bkt_sz;
+    Node* cur = bkt[bkt_num].first;
     if (nullptr == cur) {
-      bkt[bkt_num] = tmp;
+      store_slot(bkt[bkt_num], tmp);
       return;
     }
     while (cur->p_next) {
@@ -693,20 +1304,306 @@ class DelayDeleteHashtable {
     return;
   }
   
-  inline void deep_cp_bucket(Node** sbkt, size_type sbkt_sz, Node** dbkt, size_type dbkt_sz) {
+  inline void deep_cp_bucket(Buckets sbkt, size_type sbkt_sz, Buckets dbkt, size_type dbkt_sz) {
     //在rehash时使用，将一个同中节点，复制到另外一个桶内
-    if (nullptr == sbkt || nullptr == dbkt) {
+    if (!sbkt || !dbkt) {
       return;
     }
     for (size_type i = 0; i < sbkt_sz; ++i) {
-      Node* cur = sbkt[i];
+      Node* cur = sbkt[i].first;
       while (cur) {
-        deep_insert_value_to_bucket(cur->p_value, dbkt, dbkt_sz);
+        deep_insert_value_to_bucket(cur, dbkt, dbkt_sz);
         cur = cur->p_next;
       }
     }
   }
 
+  //复制节点，共享value
+  inline Node* copy_node(const Node* n) {
+    Node* tmp = new_node(n->p_value, n->hash_code);
+    tmp->hit_count.store(n->hit_count.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    return tmp;
+  }
+
+  inline void record_hit(Node* n) {
+    //采样计数，丢失部分更新无影响，不使用原子加避免热节点上的竞争
+    static thread_local uint32_t tick = 0;
+    if (0 == (++tick & (hit_sample_period_ - 1))) {
+      n->hit_count.store(n->hit_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+  }
+
+  inline bool has_equal_key(Node* first, Node* n) {
+    //multi map中相同key的节点需要相邻，不移动有相同key的节点
+    for (Node* cur = first; cur; cur = cur->p_next) {
+      if (cur != n && node_equals(extract_key_(*n->p_value), n->hash_code, cur)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  template <class Pred>
+  void sweep_bucket(Pred& pred, Buckets bkt, size_type begin, size_type end, std::vector<Node*>* removed) {
+    for (size_type i = begin; i < end; ++i) {
+      for (Node* pre = nullptr, *cur = bkt[i].first; cur; cur = cur->p_next) {
+        if (!pred(*cur->p_value)) {
+          pre = cur;
+          continue;
+        }
+        //只有第一次摘除时可能需要复制链
+        cow_chain(bkt, i, &pre, &cur);
+        if (pre) {
+          pre->p_next = cur->p_next;
+        } else {
+          store_slot(bkt[i], cur->p_next);
+        }
+        removed->push_back(cur);
+      }
+    }
+  }
+
+  size_type retire_nodes(const std::vector<Node*>& removed) {
+    std::vector<pointer> values;
+    values.reserve(removed.size());
+    for (size_type i = 0; i < removed.size(); ++i) {
+      values.push_back(removed[i]->p_value);
+      if (log_) {
+        log_->log_remove(*removed[i]->p_value);
+      }
+    }
+    value_alloc_.destroy_batch(values.begin(), values.end());
+    node_alloc_.destroy_batch(removed.begin(), removed.end());
+    n_item_ -= removed.size();
+    n_erased_ += removed.size();
+    return removed.size();
+  }
+
+  void release_bucket(int idx, bool with_value = false) {
+    //读线程和快照可能还在访问这个桶数组，放入retired_延迟到garbage_collect
+    if (bucket_[idx] || bloom_[idx]) {
+      retired_.push_back(RetiredBucket());
+      RetiredBucket& r = retired_.back();
+      r.bkt = bucket_[idx];
+      r.nbucket = nbucket_[idx];
+      r.is_shared = shared_nodes_[idx];
+      r.bloom = bloom_[idx];
+      r.with_value = with_value;
+    }
+    bucket_[idx] = nullptr;
+    nbucket_[idx] = 0;
+    shared_nodes_[idx] = false;
+    bloom_[idx] = nullptr;
+  }
+
+  //替换idx的filter，旧filter延迟到garbage_collect释放
+  void retire_bloom(int idx, BlockedBloomFilter* bloom) {
+    if (bloom_[idx]) {
+      retired_.push_back(RetiredBucket());
+      retired_.back().bloom = bloom_[idx];
+    }
+    bloom_[idx].store(bloom, std::memory_order_release);
+  }
+
+  void publish_bucket(Buckets bkt, size_type nbucket, BlockedBloomFilter* bloom, bool is_shared) {
+    int next = 1 - current_;
+    if (bucket_[next] != bkt) {
+      release_bucket(next);
+    }
+    retire_bloom(next, bloom);
+    bucket_[next] = Buckets(bkt.slots, version_.fetch_add(1, std::memory_order_relaxed) + 1);
+    nbucket_[next] = nbucket;
+    shared_nodes_[next] = false;
+    //旧桶数组与新桶数组共享未修改的链
+    shared_nodes_[current_] = is_shared;
+    mirror_ready_ = false;
+    if (!is_shared) {
+      dirty_.clear();
+      dirty_all_ = true;
+    }
+    //切换current，seq_cst与snapshot()中的登记和读取构成顺序一致的握手：
+    //读线程要么读到新的current_，要么garbage_collect看到它的登记
+    current_.store(next, std::memory_order_seq_cst);
+    //切换之后仍有快照时，换下的桶数组可能被快照固定，之后修改共享的链前先复制
+    if (is_shared && snapshot_pins_.load(std::memory_order_seq_cst) > 0) {
+      frozen_ = true;
+    }
+  }
+
+  //写线程的一次写操作，开始时write_seq_变为奇数，结束时变回偶数。
+  //is_freeze时开始写之前先固定新快照的桶数组
+  class WriteScope {
+   public:
+    WriteScope(DelayDeleteHashtable* ht, bool is_freeze = true) : ht_(ht) {
+      ht_->write_seq_.store(ht_->write_seq_.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+      if (is_freeze) {
+        ht_->freeze_snapshot();
+      }
+    }
+    ~WriteScope() {
+      ht_->write_seq_.store(ht_->write_seq_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+   private:
+    DelayDeleteHashtable* ht_;
+  };
+
+  //写线程在修改当前桶数组前调用。上次调用后有新快照时，
+  //先发布一份复制的桶数组，快照固定的桶数组之后不再被修改
+  void freeze_snapshot() {
+    size_type seq = snapshot_seq_.load(std::memory_order_seq_cst);
+    if (seq == frozen_seq_) {
+      return;
+    }
+    frozen_seq_ = seq;
+    if (0 == snapshot_pins_.load(std::memory_order_seq_cst) || !bucket_[current_]) {
+      return;
+    }
+    size_type sz = nbucket_[current_];
+    Buckets bkt = mirror_bucket();
+    if (!bkt) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__<< "freeze_snapshot no memory " << sz << std::endl;
+      return;
+    }
+    BlockedBloomFilter* bloom = nullptr;
+    if (bloom_[current_]) {
+      bloom = bloom_stale() ? new_bloom(bkt, sz) : clone_bloom(*bloom_[current_]);
+    }
+    publish_bucket(bkt, sz, bloom, true);
+  }
+
+  //frozen_时当前桶数组的链可能仍与快照固定的桶数组共享，修改桶n之前复制一份。
+  //a、b不为空时把它们指向的旧链节点换成新链中对应位置的节点
+  void cow_chain(Buckets bkt, size_type n, Node** a = nullptr, Node** b = nullptr) {
+    int old = 1 - current_;
+    if (!frozen_ || bkt != bucket_[current_] || !shared_nodes_[old]) {
+      return;
+    }
+    Node* old_first = bucket_[old][n].first;
+    if (nullptr == old_first || bkt[n].first != old_first) {
+      return;
+    }
+    size_type ia = 0;
+    size_type ib = 0;
+    for (Node* cur = old_first; cur && (!a || cur != *a); cur = cur->p_next) {
+      ++ia;
+    }
+    for (Node* cur = old_first; cur && (!b || cur != *b); cur = cur->p_next) {
+      ++ib;
+    }
+    std::vector<Node*> old_chains;
+    copy_on_write(bkt, bucket_[old], n, &old_chains);
+    //旧链仍在快照中，延迟到快照释放后的garbage_collect删除
+    delete_chain(old_first, nullptr);
+    Node* cur = bkt[n].first;
+    for (size_type i = 0; cur; ++i, cur = cur->p_next) {
+      if (a && *a && i == ia) {
+        *a = cur;
+      }
+      if (b && *b && i == ib) {
+        *b = cur;
+      }
+    }
+  }
+
+  //返回一份与当前桶数组内容相同、读线程不可见的桶数组。
+  //换下的桶数组已经garbage_collect过时复用它，只复制上次切换后修改过的桶
+  Buckets mirror_bucket() {
+    int next = 1 - current_;
+    Buckets cur = bucket_[current_];
+    size_type sz = nbucket_[current_];
+    Buckets bkt = bucket_[next];
+    if (mirror_ready_ && bkt && nbucket_[next] == sz && shared_nodes_[next]) {
+      if (dirty_all_) {
+        memcpy(bkt.slots, cur.slots, sizeof(Slot) * sz);
+      } else {
+        for (size_type i = 0; i < dirty_.size(); ++i) {
+          bkt[dirty_[i]] = cur[dirty_[i]];
+        }
+      }
+    } else {
+      bkt = new_bucket(sz);
+      if (!bkt) {
+        return bkt;
+      }
+      memcpy(bkt.slots, cur.slots, sizeof(Slot) * sz);
+    }
+    dirty_.clear();
+    dirty_all_ = false;
+    return bkt;
+  }
+
+  //记录与换下的桶数组不同的桶，超过桶数的1/8时改为整体同步
+  inline void mark_dirty(size_type n) {
+    if (dirty_all_) {
+      return;
+    }
+    if (dirty_.size() >= nbucket_[current_] / 8) {
+      dirty_all_ = true;
+      dirty_.clear();
+      return;
+    }
+    dirty_.push_back(n);
+  }
+
+  inline void set_first(Buckets bkt, size_type n, Node* first) {
+    store_slot(bkt[n], first);
+    mark_dirty(n);
+  }
+
+  inline void copy_on_write(Buckets bkt, Buckets old_bkt, size_type bkt_num, std::vector<Node*>* old_chains) {
+    //链仍与旧桶数组共享时复制一份，之后只修改复制的链
+    Node* old_first = old_bkt[bkt_num].first;
+    if (nullptr == old_first || bkt[bkt_num].first != old_first) {
+      return;
+    }
+    Node* first = nullptr;
+    Node* pre = nullptr;
+    for (Node* cur = old_first; cur; cur = cur->p_next) {
+      Node* tmp = new_node(cur->p_value, cur->hash_code);
+      if (pre) {
+        pre->p_next = tmp;
+      } else {
+        first = tmp;
+      }
+      pre = tmp;
+    }
+    set_first(bkt, bkt_num, first);
+    old_chains->push_back(old_first);
+  }
+
+  //删除元素的链，与delete_chain相同，开启日志时记录每个删除的元素
+  int remove_chain(Node* p_begin, Node* p_end) {
+    if (log_) {
+      for (Node* cur = p_begin; cur != p_end; cur = cur->p_next) {
+        log_->log_remove(*cur->p_value);
+      }
+    }
+    int cnt = delete_chain(p_begin, p_end, true);
+    n_erased_ += cnt;
+    return cnt;
+  }
+
+  //上次重建filter后删除的元素是否已经超过阈值
+  inline bool bloom_stale() const {
+    return n_erased_ > n_item_ * bloom_rebuild_ratio_;
+  }
+
+  //写线程在erase之后调用，删除累计超过阈值时重建当前桶数组的filter，
+  //旧filter可能还有读线程在查，延迟到garbage_collect释放
+  void maybe_rebuild_bloom() {
+    if (!bloom_[current_] || !bloom_stale()) {
+      return;
+    }
+    BlockedBloomFilter* bloom = new_bloom(bucket_[current_], nbucket_[current_]);
+    if (!bloom) {
+      return;
+    }
+    retired_.push_back(RetiredBucket());
+    retired_.back().bloom = bloom_[current_];
+    bloom_[current_].store(bloom, std::memory_order_release);
+  }
+
   int delete_chain(Node* p_begin, Node* p_end, bool with_value = false) {
     int cnt = 0;
     while (p_begin != p_end) {
@@ -718,29 +1615,64 @@ class DelayDeleteHashtable {
     return cnt;
   }
 
-  void delete_bucket(Node** bkt, size_t sz, bool with_value = false) {
-    if (nullptr == bkt) {
+  void delete_bucket(const RetiredBucket& r) {
+    delete r.bloom;
+    if (!r.bkt) {
       return;
     }
-    //删除开链中的每个元素
-    for (int i = 0; i < sz; ++i) {
-      if (nullptr != bkt[i]) {
-        delete_chain(bkt[i], nullptr, with_value);
+    if (!r.is_shared) {
+      //删除开链中的每个元素，is_shared时节点已经属于后一个桶数组
+      for (size_type i = 0; i < r.nbucket; ++i) {
+        if (nullptr != r.bkt[i].first) {
+          delete_chain(r.bkt[i].first, nullptr, r.with_value);
+        }
       }
     }
-    delete [] bkt;
+    huge_page_free(r.bkt.slots);
   }
 
-  Node** new_bucket(size_t sz) {
-    Node** bkt = new (std::nothrow) Node* [sz];
-    if (!bkt) {
+  BlockedBloomFilter* new_bloom(Buckets bkt, size_type sz) {
+    //按max_load_factor下的容量分配
+    BlockedBloomFilter* bloom = new (std::nothrow) BlockedBloomFilter();
+    if (!bloom || bloom->init(sz * max_load_factor_, bloom_bits_per_item_) != 0) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__<< "new_bloom no memory " << sz << std::endl;
+      delete bloom;
+      return nullptr;
+    }
+    fill_bloom(bloom, bkt, sz);
+    n_erased_ = 0;
+    return bloom;
+  }
+
+  void fill_bloom(BlockedBloomFilter* bloom, Buckets bkt, size_type sz) {
+    for (size_type i = 0; i < sz; ++i) {
+      for (Node* cur = bkt[i].first; cur; cur = cur->p_next) {
+        bloom->add(cur->hash_code);
+      }
+    }
+  }
+
+  BlockedBloomFilter* clone_bloom(const BlockedBloomFilter& other) {
+    BlockedBloomFilter* bloom = new (std::nothrow) BlockedBloomFilter();
+    if (!bloom || bloom->init_copy(other) != 0) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__<< "clone_bloom no memory" << std::endl;
+      delete bloom;
+      return nullptr;
+    }
+    return bloom;
+  }
+
+  Buckets new_bucket(size_t sz) {
+    //大桶数组使用huge page，新映射的匿名页已经清零
+    Slot* slots = static_cast<Slot*>(huge_page_alloc(sizeof(Slot) * sz));
+    if (!slots) {
       std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__<< "new_bucket no memory " << sz << std::endl;
       return nullptr;
     }
-    memset(bkt, 0, sizeof(Node*) * sz);
-    return bkt;
+    return Buckets(slots);
   }
 
+  DelayDeleteArenaSet arena_;    //需要在allocator之后析构
   value_allocator value_alloc_;
   node_allocator node_alloc_;
   key_equal equals_;
@@ -749,9 +1681,28 @@ class DelayDeleteHashtable {
   double max_load_factor_ {1.0};  // max  n_item / nbucket_;
   size_t n_item_ {0};    //元素数量
   size_t nbucket_[2] {0, 0};   //桶的数量
-  Node** bucket_[2] {nullptr, nullptr};
-  int current_ {0};
+  Buckets bucket_[2] {nullptr, nullptr};
+  std::atomic<BlockedBloomFilter*> bloom_[2] {{nullptr}, {nullptr}};   //与bucket_一一对应，为空表示未开启
+  bool shared_nodes_[2] {false, false};   //为true时桶数组的节点属于另一个桶数组
+  std::vector<size_type> dirty_;   //上次切换后当前桶数组修改过的桶
+  bool dirty_all_ {true};          //修改过的桶太多或未知，同步时整体复制
+  bool mirror_ready_ {false};      //换下的桶数组已经没有读线程，可以复用
+  size_type bloom_bits_per_item_ {0};
+  double bloom_rebuild_ratio_ {0.25};
+  size_type n_erased_ {0};   //上次重建filter后删除的元素数
+  std::atomic<int> current_ {0};   //读线程读取，写线程切换
   int resize_count_{0};
+  std::atomic<size_type> version_ {0};   //桶数组代数的计数
+  uint32_t hit_sample_period_ {0};   //0表示不采样
+  std::atomic<int> snapshot_pins_ {0};   //存活的快照数
+  std::atomic<size_type> snapshot_seq_ {0};   //快照登记次数
+  std::atomic<size_type> write_seq_ {0};      //写操作进行中时为奇数
+  size_type frozen_seq_ {0};   //写线程已经固定过的快照数
+  bool frozen_ {false};        //换下的桶数组可能被快照固定，修改共享的链前先复制
+  DelayDeleteTableLog<Val>* log_ {nullptr};
+  std::vector<RetiredBucket> retired_;   //换下的桶数组，garbage_collect时释放
+  size_type reorder_pos_ {0};
+  size_type compact_pos_ {0};
 };
 
 }
@@ -0,0 +1,155 @@
+#ifndef UTILS_DELAY_DELETE_UPDATE_QUEUE_HPP_
+#define UTILS_DELAY_DELETE_UPDATE_QUEUE_HPP_
+
+#include <atomic>
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+
+namespace utils {
+
+//多生产者单消费者的无锁更新队列。
+//任意线程push_insert/push_update/push_erase，只做一次原子exchange，不会阻塞；
+//写线程drain批量取出，同一key的多次操作合并为一次后逐个执行。
+//链表结构见Vyukov intrusive MPSC queue。
+template <class Key, class Value, class Hash, class Equal>
+class DelayDeleteUpdateQueue {
+ public:
+  enum OpType {
+    kInsert = 0,    // 插入或替换
+    kUpdate = 1,    // 只替换已存在的key
+    kErase = 2,
+  };
+
+  DelayDeleteUpdateQueue() : head_(&stub_), tail_(&stub_) {}
+  ~DelayDeleteUpdateQueue() {
+    for (Node* n = pop(); n; n = pop()) {
+      delete_node(n);
+    }
+  }
+
+  //生产者接口，可以在任意线程调用
+  void push_insert(const Key& key, const Value& obj) {
+    push(new_node(kInsert, key, &obj));
+  }
+  void push_update(const Key& key, const Value& obj) {
+    push(new_node(kUpdate, key, &obj));
+  }
+  void push_erase(const Key& key) {
+    push(new_node(kErase, key, nullptr));
+  }
+
+  //消费者接口，只能在写线程调用。
+  //取出最多max_op个操作，合并后对每个key调用一次apply(key, value)，
+  //value为nullptr表示删除。exists判断key当前是否存在，
+  //合并后仍是kUpdate的操作只在key存在时执行。返回取出的操作数
+  template <class Exists, class Apply>
+  size_t drain(size_t max_op, Exists exists, Apply apply) {
+    size_t n = 0;
+    for (; n < max_op; ++n) {
+      Node* node = pop();
+      if (!node) {
+        break;
+      }
+      std::pair<typename std::unordered_map<Key, size_t, Hash, Equal>::iterator, bool> ret =
+          index_.insert(std::make_pair(node->key, pending_.size()));
+      if (ret.second) {
+        pending_.push_back(node);
+        continue;
+      }
+      Node*& last = pending_[ret.first->second];
+      if (kUpdate == node->type && kErase == last->type) {
+        //删除后的update没有作用
+        delete_node(node);
+        continue;
+      }
+      if (kUpdate == node->type && kInsert == last->type) {
+        node->type = kInsert;
+      }
+      delete_node(last);
+      last = node;
+    }
+    for (size_t i = 0; i < pending_.size(); ++i) {
+      Node* node = pending_[i];
+      if (kErase == node->type) {
+        apply(node->key, static_cast<const Value*>(nullptr));
+      } else if (kInsert == node->type || exists(node->key)) {
+        apply(node->key, static_cast<const Value*>(node->value));
+      }
+      delete_node(node);
+    }
+    pending_.clear();
+    index_.clear();
+    return n;
+  }
+
+ private:
+  //stub_只有链接指针，Key和Value不需要默认构造
+  struct Link {
+    std::atomic<Link*> next {nullptr};
+  };
+  struct Node : Link {
+    Node(int t, const Key& k, Value* v) : type(t), key(k), value(v) {}
+    int type;
+    Key key;
+    Value* value;
+  };
+
+  DelayDeleteUpdateQueue(const DelayDeleteUpdateQueue&) = delete;
+  DelayDeleteUpdateQueue& operator = (const DelayDeleteUpdateQueue&) = delete;
+
+  Node* new_node(int type, const Key& key, const Value* obj) {
+    return new Node(type, key, obj ? new Value(*obj) : nullptr);
+  }
+
+  void delete_node(Node* n) {
+    delete n->value;
+    delete n;
+  }
+
+  void push(Link* n) {
+    n->next.store(nullptr, std::memory_order_relaxed);
+    Link* prev = head_.exchange(n, std::memory_order_acq_rel);
+    //exchange之后、设置prev->next之前，消费者看不到n及之后的节点
+    prev->next.store(n, std::memory_order_release);
+  }
+
+  //队列为空或者生产者正在push时返回nullptr
+  Node* pop() {
+    Link* tail = tail_;
+    Link* next = tail->next.load(std::memory_order_acquire);
+    if (&stub_ == tail) {
+      if (!next) {
+        return nullptr;
+      }
+      tail_ = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next) {
+      tail_ = next;
+      return static_cast<Node*>(tail);
+    }
+    if (tail != head_.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    //tail是最后一个节点，放回stub后才能取出tail
+    push(&stub_);
+    next = tail->next.load(std::memory_order_acquire);
+    if (next) {
+      tail_ = next;
+      return static_cast<Node*>(tail);
+    }
+    return nullptr;
+  }
+
+  std::atomic<Link*> head_;     // 生产者端
+  Link* tail_;                  // 消费者端
+  Link stub_;
+  std::vector<Node*> pending_;  // drain时合并后的操作
+  std::unordered_map<Key, size_t, Hash, Equal> index_;   // key在pending_中的下标
+};
+
+}
+
+#endif
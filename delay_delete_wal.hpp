@@ -0,0 +1,769 @@
+#ifndef UTILS_DELAY_DELETE_WAL_HPP_
+#define UTILS_DELAY_DELETE_WAL_HPP_
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "delay_delete_allocator.hpp"
+#include "delay_delete_hash.hpp"
+#include "delay_delete_table.hpp"
+
+namespace utils {
+
+//key和value的序列化，trivially copyable类型按内存拷贝，
+//std::string和元素trivially copyable的std::vector按内容拷贝，其它类型需要特化。
+//恢复时按序列化后的字节比较key，有padding的结构体需要保证padding为0
+template <class T, class Enable = void>
+struct DelayDeleteCodec {
+  static_assert(std::is_trivially_copyable<T>::value, "DelayDeleteCodec needs a specialization");
+  static void encode(const T& v, std::string* out) {
+    out->append(reinterpret_cast<const char*>(&v), sizeof(T));
+  }
+  static bool decode(const char* p, size_t len, T* v) {
+    if (len != sizeof(T)) {
+      return false;
+    }
+    memcpy(v, p, sizeof(T));
+    return true;
+  }
+};
+
+template <>
+struct DelayDeleteCodec<std::string> {
+  static void encode(const std::string& v, std::string* out) {
+    out->append(v);
+  }
+  static bool decode(const char* p, size_t len, std::string* v) {
+    v->assign(p, len);
+    return true;
+  }
+};
+
+template <class T>
+struct DelayDeleteCodec<std::vector<T>, typename std::enable_if<std::is_trivially_copyable<T>::value>::type> {
+  static void encode(const std::vector<T>& v, std::string* out) {
+    out->append(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+  }
+  static bool decode(const char* p, size_t len, std::vector<T>* v) {
+    if (len % sizeof(T)) {
+      return false;
+    }
+    v->resize(len / sizeof(T));
+    memcpy(v->data(), p, len);
+    return true;
+  }
+};
+
+struct DelayDeleteWalOptions {
+  size_t segment_bytes {64 << 20};        // 日志段大小，超过后换新文件
+  size_t group_commit_bytes {1 << 20};    // 缓冲超过后写入文件，commit时才sync
+  bool sync {true};                       // commit和checkpoint时是否fdatasync
+  size_t n_partition {256};               // checkpoint按key hash分区，只重写修改过的分区
+  size_t replay_threads {4};              // 恢复时并行处理分区的线程数
+};
+
+static const uint32_t kWalCheckpointMagic = 0x4b434444;   // "DDCK"
+static const uint64_t kWalHashSeed = 0x57414c3031ull;     // 分区和校验使用固定种子，重启后不变
+
+struct WalRecordHeader {
+  uint32_t len;         // key和value的总长度
+  uint32_t checksum;    // lsn开始到记录结束
+  uint64_t lsn;
+  uint32_t type;
+  uint32_t key_len;
+};
+
+struct WalCheckpointHeader {
+  uint32_t magic;
+  uint32_t checksum;    // body的校验
+  uint64_t lsn;         // 分区写入时的lsn
+  uint64_t count;
+  uint64_t body_len;
+};
+
+//map的写前日志和增量checkpoint，由写线程使用。
+//table在每次修改生效时回调log_put/log_append/log_remove，记录追加到内存缓冲，
+//缓冲超过group_commit_bytes或者commit时写入当前日志段，commit时sync，
+//一次sync提交一组修改。commit返回0之后的修改在进程崩溃后可以恢复。
+//目录结构：
+//  wal.<起始lsn>   日志段，记录为WalRecordHeader + key + value
+//  ckpt.<分区>     分区的全部元素，WalCheckpointHeader + (key长度 key value长度 value)*
+//  MANIFEST       最近一次完成的checkpoint的lsn和分区数
+//checkpoint只重写自上次以来有修改的分区，按分区的key索引查表取出元素，完成后删除旧日志段。
+//write batch的记录前后有开始和结束记录，恢复时丢弃没有结束记录的batch。
+//恢复时每个分区加载自己的ckpt文件，再按lsn回放该分区的日志，分区之间并行。
+//Table是map内部的DelayDeleteHashtable，map只在enable_wal时构造DelayDeleteWal
+template <class Key, class Val, class Table>
+class DelayDeleteWal : public DelayDeleteTableLog<std::pair<const Key, Val> > {
+ public:
+  typedef std::pair<const Key, Val> value_type;
+  enum RecordType {
+    kPut = 1,       // 插入或替换
+    kAppend = 2,    // 相同key追加一个元素
+    kRemove = 3,    // 删除一个元素
+    kClear = 4,
+    kBatchBegin = 5,
+    kBatchEnd = 6,
+  };
+
+  DelayDeleteWal() {}
+  ~DelayDeleteWal() {
+    commit();
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  //打开dir，已有checkpoint和日志时恢复到ht中，is_unique表示ht是否按insert_unique插入。
+  //ht不为空时dir中不能有数据，开启后立即做一次checkpoint
+  int open(const std::string& dir, const DelayDeleteWalOptions& options, Table* ht, bool is_unique) {
+    if (fd_ >= 0) {
+      return -1;
+    }
+    ht_ = ht;
+    dir_ = dir;
+    options_ = options;
+    is_unique_ = is_unique;
+    if (mkdir(dir.c_str(), 0755) != 0 && EEXIST != errno) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " mkdir fail " << dir << " errno " << errno << std::endl;
+      return -1;
+    }
+    uint64_t ckpt_lsn = 0;
+    size_t n_partition = options_.n_partition ? options_.n_partition : 1;
+    std::string manifest;
+    bool has_manifest = read_file(dir_ + "/MANIFEST", &manifest);
+    if (has_manifest) {
+      unsigned long long lsn = 0;
+      unsigned long long n = 0;
+      if (sscanf(manifest.c_str(), "%llu %llu", &lsn, &n) != 2 || 0 == n) {
+        std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " bad manifest " << dir << std::endl;
+        return -1;
+      }
+      ckpt_lsn = lsn;
+      n_partition = n;
+    }
+    options_.n_partition = n_partition;
+    std::vector<uint64_t> segments = list_segments();
+    size_t init_size = ht->size();
+    if (init_size && (has_manifest || !segments.empty())) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " map not empty, wal dir has data " << dir << std::endl;
+      return -1;
+    }
+    dirty_.assign(n_partition, false);
+    keys_.assign(n_partition, std::unordered_set<std::string>());
+    manifest_lsn_ = ckpt_lsn;
+    next_lsn_ = ckpt_lsn + 1;
+    if (recover(segments, ckpt_lsn) != 0) {
+      return -1;
+    }
+    if (open_segment() != 0) {
+      return -1;
+    }
+    if (init_size) {
+      //只有开启时扫描一次全表建立key索引
+      std::string key;
+      for (typename Table::iterator it = ht_->begin(); it != ht_->end(); ++it) {
+        key.clear();
+        DelayDeleteCodec<Key>::encode(it->first, &key);
+        keys_[partition(key.data(), key.size())].insert(key);
+      }
+      dirty_.assign(n_partition, true);
+      return checkpoint();
+    }
+    return 0;
+  }
+
+  void log_put(const value_type& obj) override {
+    append(kPut, &obj);
+  }
+  void log_append(const value_type& obj) override {
+    append(kAppend, &obj);
+  }
+  void log_remove(const value_type& obj) override {
+    append(kRemove, &obj);
+  }
+  void log_clear() override {
+    append(kClear, nullptr);
+    dirty_.assign(dirty_.size(), true);
+    for (size_t p = 0; p < keys_.size(); ++p) {
+      keys_[p].clear();
+    }
+  }
+  void log_batch_begin() override {
+    append(kBatchBegin, nullptr);
+  }
+  void log_batch_end() override {
+    append(kBatchEnd, nullptr);
+  }
+
+  //写入缓冲中的记录并sync，返回0后之前的修改都已持久化。
+  //写文件失败后日志不再完整，之后一直返回-1
+  int commit() override {
+    if (fd_ < 0 || error_) {
+      return -1;
+    }
+    if (write_buffer() != 0) {
+      return -1;
+    }
+    if (options_.sync && unsynced_ && fdatasync(fd_) != 0) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " fdatasync fail errno " << errno << std::endl;
+      error_ = true;
+      return -1;
+    }
+    unsynced_ = false;
+    return 0;
+  }
+
+  //增量checkpoint，只在写线程调用。
+  //重写修改过的分区，更新MANIFEST，然后换新的日志段并删除旧日志段
+  int checkpoint() override {
+    if (commit() != 0) {
+      return -1;
+    }
+    if (std::find(dirty_.begin(), dirty_.end(), true) == dirty_.end()) {
+      return 0;
+    }
+    uint64_t lsn = next_lsn_ - 1;
+    //修改过的分区按key索引查表，在内存中拼好再写文件
+    size_t n_partition = dirty_.size();
+    std::string body;
+    for (size_t p = 0; p < n_partition; ++p) {
+      if (!dirty_[p]) {
+        continue;
+      }
+      uint64_t count = 0;
+      if (encode_partition(p, &body, &count) != 0) {
+        return -1;
+      }
+      WalCheckpointHeader header;
+      header.magic = kWalCheckpointMagic;
+      header.checksum = (uint32_t)hash_bytes(body.data(), body.size(), kWalHashSeed);
+      header.lsn = lsn;
+      header.count = count;
+      header.body_len = body.size();
+      std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+      data.append(body);
+      if (write_file(checkpoint_path(p), data) != 0) {
+        return -1;
+      }
+    }
+    char manifest[64];
+    snprintf(manifest, sizeof(manifest), "%llu %llu\n", (unsigned long long)lsn, (unsigned long long)n_partition);
+    if (write_file(dir_ + "/MANIFEST", manifest) != 0) {
+      return -1;
+    }
+    manifest_lsn_ = lsn;
+    dirty_.assign(n_partition, false);
+    //之后的记录写入新段，lsn不超过checkpoint的旧段全部删除
+    close(fd_);
+    fd_ = -1;
+    if (open_segment() != 0) {
+      return -1;
+    }
+    std::vector<uint64_t> segments = list_segments();
+    for (size_t i = 0; i < segments.size(); ++i) {
+      if (segments[i] < segment_lsn_) {
+        unlink(segment_path(segments[i]).c_str());
+      }
+    }
+    return 0;
+  }
+
+  uint64_t last_lsn() const { return next_lsn_ - 1; }
+  uint64_t checkpoint_lsn() const { return manifest_lsn_; }
+
+ private:
+  DelayDeleteWal(const DelayDeleteWal&) = delete;
+  DelayDeleteWal& operator = (const DelayDeleteWal&) = delete;
+
+  //恢复时一个分区的状态，key和value都是序列化后的字节
+  typedef std::unordered_map<std::string, std::vector<std::string> > PartitionState;
+
+  size_t partition(const char* key, size_t len) const {
+    return hash_bytes(key, len, kWalHashSeed) % dirty_.size();
+  }
+
+  //分区p的全部元素，key索引中已经不在表里的key顺便删除
+  int encode_partition(size_t p, std::string* body, uint64_t* count) {
+    body->clear();
+    *count = 0;
+    std::unordered_set<std::string>& keys = keys_[p];
+    for (std::unordered_set<std::string>::iterator k = keys.begin(); k != keys.end();) {
+      Key key;
+      if (!DelayDeleteCodec<Key>::decode(k->data(), k->size(), &key)) {
+        std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " decode fail partition " << p << std::endl;
+        return -1;
+      }
+      //相同key的元素在链上相邻，按个数遍历
+      size_t n = ht_->count(key);
+      if (0 == n) {
+        k = keys.erase(k);
+        continue;
+      }
+      typename Table::iterator it = ht_->find(key);
+      for (; n > 0; --n, ++it) {
+        append_field(body, k->data(), k->size());
+        size_t pos = body->size();
+        body->append(sizeof(uint32_t), '\0');
+        DelayDeleteCodec<Val>::encode(it->second, body);
+        uint32_t vlen = body->size() - pos - sizeof(uint32_t);
+        memcpy(&(*body)[pos], &vlen, sizeof(vlen));
+        ++*count;
+      }
+      ++k;
+    }
+    return 0;
+  }
+
+  static void append_field(std::string* out, const char* p, size_t len) {
+    uint32_t n = len;
+    out->append(reinterpret_cast<const char*>(&n), sizeof(n));
+    out->append(p, len);
+  }
+
+  void append(int type, const value_type* obj) {
+    size_t pos = buffer_.size();
+    buffer_.append(sizeof(WalRecordHeader), '\0');
+    WalRecordHeader header;
+    header.key_len = 0;
+    if (obj) {
+      DelayDeleteCodec<Key>::encode(obj->first, &buffer_);
+      header.key_len = buffer_.size() - pos - sizeof(header);
+      DelayDeleteCodec<Val>::encode(obj->second, &buffer_);
+      const char* key = &buffer_[pos + sizeof(header)];
+      size_t p = partition(key, header.key_len);
+      dirty_[p] = true;
+      //删除时key可能还有其它元素，留到checkpoint查表时再从索引删除
+      if (kRemove != type) {
+        keys_[p].insert(std::string(key, header.key_len));
+      }
+    }
+    header.len = buffer_.size() - pos - sizeof(header);
+    header.lsn = next_lsn_++;
+    header.type = type;
+    header.checksum = 0;
+    memcpy(&buffer_[pos], &header, sizeof(header));
+    header.checksum = record_checksum(&buffer_[pos]);
+    memcpy(&buffer_[pos], &header, sizeof(header));
+    if (buffer_.size() >= options_.group_commit_bytes) {
+      write_buffer();
+    }
+  }
+
+  //缓冲和日志段中的记录不保证按header对齐，header先复制出来再读
+  static WalRecordHeader load_header(const char* record) {
+    WalRecordHeader header;
+    memcpy(&header, record, sizeof(header));
+    return header;
+  }
+
+  static uint32_t record_checksum(const char* record) {
+    const size_t skip = offsetof(WalRecordHeader, lsn);
+    return (uint32_t)hash_bytes(record + skip, sizeof(WalRecordHeader) - skip + load_header(record).len, kWalHashSeed);
+  }
+
+  int write_buffer() {
+    if (buffer_.empty()) {
+      return 0;
+    }
+    if (fd_ < 0 || error_) {
+      return -1;
+    }
+    if (segment_size_ && segment_size_ + buffer_.size() > options_.segment_bytes) {
+      //换段前sync旧段，恢复时只有最后一段可能不完整
+      if (options_.sync && unsynced_ && fdatasync(fd_) != 0) {
+        std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " fdatasync fail errno " << errno << std::endl;
+        error_ = true;
+        return -1;
+      }
+      close(fd_);
+      fd_ = -1;
+      if (open_segment(load_header(buffer_.data()).lsn) != 0) {
+        return -1;
+      }
+    }
+    if (write_all(fd_, buffer_.data(), buffer_.size()) != 0) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " write fail errno " << errno << std::endl;
+      error_ = true;
+      return -1;
+    }
+    segment_size_ += buffer_.size();
+    unsynced_ = true;
+    buffer_.clear();
+    return 0;
+  }
+
+  int open_segment(uint64_t lsn = 0) {
+    segment_lsn_ = lsn ? lsn : next_lsn_;
+    std::string path = segment_path(segment_lsn_);
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " open fail " << path << " errno " << errno << std::endl;
+      error_ = true;
+      return -1;
+    }
+    segment_size_ = 0;
+    sync_dir();
+    return 0;
+  }
+
+  std::string segment_path(uint64_t lsn) const {
+    char name[32];
+    snprintf(name, sizeof(name), "/wal.%020llu", (unsigned long long)lsn);
+    return dir_ + name;
+  }
+
+  std::string checkpoint_path(size_t p) const {
+    return dir_ + "/ckpt." + std::to_string(p);
+  }
+
+  //按起始lsn排序的日志段
+  std::vector<uint64_t> list_segments() const {
+    std::vector<uint64_t> segments;
+    DIR* d = opendir(dir_.c_str());
+    if (!d) {
+      return segments;
+    }
+    for (struct dirent* e = readdir(d); e; e = readdir(d)) {
+      unsigned long long lsn = 0;
+      if (0 == strncmp(e->d_name, "wal.", 4) && sscanf(e->d_name + 4, "%llu", &lsn) == 1) {
+        segments.push_back(lsn);
+      }
+    }
+    closedir(d);
+    std::sort(segments.begin(), segments.end());
+    return segments;
+  }
+
+  int recover(const std::vector<uint64_t>& segments, uint64_t ckpt_lsn) {
+    //读出所有日志段，按分区分组checkpoint之后的记录
+    size_t n_partition = dirty_.size();
+    std::vector<std::string> data(segments.size());
+    std::vector<std::vector<const char*> > records(n_partition);
+    uint64_t last_lsn = ckpt_lsn;
+    //batch中的记录先放入pending，读到结束记录后再分到分区，n_partition表示所有分区
+    std::vector<std::pair<size_t, const char*> > pending;
+    bool in_batch = false;
+    size_t batch_segment = 0;
+    size_t batch_off = 0;
+    for (size_t i = 0; i < segments.size(); ++i) {
+      std::string path = segment_path(segments[i]);
+      if (!read_file(path, &data[i])) {
+        std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " read fail " << path << std::endl;
+        return -1;
+      }
+      const std::string& seg = data[i];
+      size_t off = 0;
+      while (off + sizeof(WalRecordHeader) <= seg.size()) {
+        const char* record = seg.data() + off;
+        WalRecordHeader header = load_header(record);
+        if (header.len > seg.size() - off - sizeof(WalRecordHeader) ||
+            header.key_len > header.len ||
+            header.checksum != record_checksum(record)) {
+          break;
+        }
+        if (kBatchBegin == header.type) {
+          pending.clear();
+          in_batch = true;
+          batch_segment = i;
+          batch_off = off;
+        } else if (kBatchEnd == header.type) {
+          for (size_t j = 0; j < pending.size(); ++j) {
+            for (size_t p = 0; p < n_partition; ++p) {
+              if (pending[j].first == p || pending[j].first == n_partition) {
+                records[p].push_back(pending[j].second);
+              }
+            }
+          }
+          pending.clear();
+          in_batch = false;
+        } else if (header.lsn > ckpt_lsn) {
+          size_t p = kClear == header.type ? n_partition : partition(record + sizeof(WalRecordHeader), header.key_len);
+          if (in_batch) {
+            pending.push_back(std::make_pair(p, record));
+          } else if (p == n_partition) {
+            for (size_t q = 0; q < n_partition; ++q) {
+              records[q].push_back(record);
+            }
+          } else {
+            records[p].push_back(record);
+          }
+        }
+        last_lsn = std::max<uint64_t>(last_lsn, header.lsn);
+        off += sizeof(WalRecordHeader) + header.len;
+      }
+      if (off < seg.size()) {
+        if (i + 1 != segments.size()) {
+          std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " corrupt record " << path << " offset " << off << std::endl;
+          return -1;
+        }
+        //最后一段末尾是崩溃时没写完的记录，截掉
+        if (truncate(path.c_str(), off) != 0) {
+          std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " truncate fail " << path << " errno " << errno << std::endl;
+          return -1;
+        }
+      }
+    }
+    if (in_batch) {
+      //崩溃时batch没有写完，丢弃它的记录，从batch开始处截掉日志
+      std::string path = segment_path(segments[batch_segment]);
+      if (truncate(path.c_str(), batch_off) != 0) {
+        std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " truncate fail " << path << " errno " << errno << std::endl;
+        return -1;
+      }
+      for (size_t i = batch_segment + 1; i < segments.size(); ++i) {
+        unlink(segment_path(segments[i]).c_str());
+      }
+      sync_dir();
+    }
+
+    //每个线程处理一部分分区：加载ckpt，回放日志，解码
+    size_t n_thread = options_.replay_threads ? options_.replay_threads : 1;
+    if (n_thread > n_partition) {
+      n_thread = n_partition;
+    }
+    std::vector<std::vector<std::pair<Key, Val> > > values(n_thread);
+    std::vector<uint64_t> partition_lsn(n_partition, 0);
+    std::vector<int> ret(n_thread, 0);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < n_thread; ++t) {
+      workers.push_back(std::thread([this, t, n_thread, n_partition, ckpt_lsn, &records, &values, &partition_lsn, &ret]() {
+        for (size_t p = t; p < n_partition && 0 == ret[t]; p += n_thread) {
+          ret[t] = replay_partition(p, ckpt_lsn, records[p], &partition_lsn[p], &values[t]);
+        }
+      }));
+    }
+    for (size_t t = 0; t < n_thread; ++t) {
+      workers[t].join();
+    }
+    for (size_t t = 0; t < n_thread; ++t) {
+      if (ret[t] != 0) {
+        return -1;
+      }
+    }
+    for (size_t t = 0; t < n_thread; ++t) {
+      for (size_t i = 0; i < values[t].size(); ++i) {
+        value_type obj(std::move(values[t][i].first), std::move(values[t][i].second));
+        if (is_unique_) {
+          ht_->insert_unique(obj, true, true);
+        } else {
+          ht_->insert_equal(obj);
+        }
+      }
+      std::vector<std::pair<Key, Val> >().swap(values[t]);
+    }
+    for (size_t p = 0; p < n_partition; ++p) {
+      //回放过日志的分区与ckpt文件不一致，下次checkpoint时重写
+      dirty_[p] = !records[p].empty() &&
+                  load_header(records[p].back()).lsn > partition_lsn[p];
+      last_lsn = std::max(last_lsn, partition_lsn[p]);
+    }
+    next_lsn_ = last_lsn + 1;
+    return 0;
+  }
+
+  int replay_partition(size_t p, uint64_t ckpt_lsn, const std::vector<const char*>& records,
+                       uint64_t* partition_lsn, std::vector<std::pair<Key, Val> >* out) {
+    PartitionState state;
+    std::string data;
+    std::string path = checkpoint_path(p);
+    *partition_lsn = 0;
+    if (read_file(path, &data)) {
+      WalCheckpointHeader header;
+      bool is_valid = data.size() >= sizeof(header);
+      if (is_valid) {
+        memcpy(&header, data.data(), sizeof(header));
+        is_valid = header.magic == kWalCheckpointMagic &&
+                   header.body_len == data.size() - sizeof(header) &&
+                   header.checksum == (uint32_t)hash_bytes(data.data() + sizeof(header), header.body_len, kWalHashSeed);
+      }
+      if (!is_valid) {
+        std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " bad checkpoint " << path << std::endl;
+        return -1;
+      }
+      *partition_lsn = header.lsn;
+      const char* cur = data.data() + sizeof(WalCheckpointHeader);
+      const char* end = data.data() + data.size();
+      for (uint64_t i = 0; i < header.count; ++i) {
+        const char* key = nullptr;
+        const char* value = nullptr;
+        uint32_t klen = 0;
+        uint32_t vlen = 0;
+        if (!read_field(&cur, end, &key, &klen) || !read_field(&cur, end, &value, &vlen)) {
+          std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " bad checkpoint " << path << std::endl;
+          return -1;
+        }
+        state[std::string(key, klen)].push_back(std::string(value, vlen));
+      }
+    }
+    //MANIFEST之后重写过的分区，ckpt文件已包含更早的记录
+    uint64_t from = std::max(ckpt_lsn, *partition_lsn);
+    for (size_t i = 0; i < records.size(); ++i) {
+      WalRecordHeader header = load_header(records[i]);
+      if (header.lsn <= from) {
+        continue;
+      }
+      if (kClear == header.type) {
+        state.clear();
+        continue;
+      }
+      const char* key = records[i] + sizeof(WalRecordHeader);
+      std::string k(key, header.key_len);
+      std::string v(key + header.key_len, header.len - header.key_len);
+      if (kPut == header.type) {
+        std::vector<std::string>& list = state[k];
+        list.clear();
+        list.push_back(v);
+      } else if (kAppend == header.type) {
+        state[k].push_back(v);
+      } else if (kRemove == header.type) {
+        typename PartitionState::iterator it = state.find(k);
+        if (it == state.end()) {
+          continue;
+        }
+        std::vector<std::string>& list = it->second;
+        if (is_unique_) {
+          list.clear();
+        } else {
+          std::vector<std::string>::iterator pos = std::find(list.begin(), list.end(), v);
+          if (pos != list.end()) {
+            list.erase(pos);
+          }
+        }
+        if (list.empty()) {
+          state.erase(it);
+        }
+      }
+    }
+    for (typename PartitionState::iterator it = state.begin(); it != state.end(); ++it) {
+      keys_[p].insert(it->first);
+      for (size_t i = 0; i < it->second.size(); ++i) {
+        out->push_back(std::pair<Key, Val>());
+        std::pair<Key, Val>& kv = out->back();
+        const std::string& v = it->second[i];
+        if (!DelayDeleteCodec<Key>::decode(it->first.data(), it->first.size(), &kv.first) ||
+            !DelayDeleteCodec<Val>::decode(v.data(), v.size(), &kv.second)) {
+          std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " decode fail partition " << p << std::endl;
+          return -1;
+        }
+      }
+    }
+    return 0;
+  }
+
+  static bool read_field(const char** cur, const char* end, const char** p, uint32_t* len) {
+    if (end - *cur < (ptrdiff_t)sizeof(uint32_t)) {
+      return false;
+    }
+    memcpy(len, *cur, sizeof(uint32_t));
+    *cur += sizeof(uint32_t);
+    if (end - *cur < (ptrdiff_t)*len) {
+      return false;
+    }
+    *p = *cur;
+    *cur += *len;
+    return true;
+  }
+
+  static int write_all(int fd, const char* p, size_t len) {
+    while (len > 0) {
+      ssize_t n = write(fd, p, len);
+      if (n < 0) {
+        if (EINTR == errno) {
+          continue;
+        }
+        return -1;
+      }
+      p += n;
+      len -= n;
+    }
+    return 0;
+  }
+
+  static bool read_file(const std::string& path, std::string* data) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    data->clear();
+    char buf[1 << 16];
+    while (true) {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n < 0 && EINTR == errno) {
+        continue;
+      }
+      if (n <= 0) {
+        close(fd);
+        return 0 == n;
+      }
+      data->append(buf, n);
+    }
+  }
+
+  //先写临时文件再rename，文件要么是旧内容要么是完整的新内容
+  int write_file(const std::string& path, const std::string& data) {
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " open fail " << tmp << " errno " << errno << std::endl;
+      return -1;
+    }
+    if (write_all(fd, data.data(), data.size()) != 0 || (options_.sync && fdatasync(fd) != 0)) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " write fail " << tmp << " errno " << errno << std::endl;
+      close(fd);
+      return -1;
+    }
+    close(fd);
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+      std::cerr << __FILE__ << ":" << __LINE__ << ":" << __FUNCTION__ << " rename fail " << path << " errno " << errno << std::endl;
+      return -1;
+    }
+    sync_dir();
+    return 0;
+  }
+
+  void sync_dir() {
+    if (!options_.sync) {
+      return;
+    }
+    int fd = ::open(dir_.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      fsync(fd);
+      close(fd);
+    }
+  }
+
+  Table* ht_ {nullptr};
+  std::string dir_;
+  DelayDeleteWalOptions options_;
+  bool is_unique_ {true};
+  int fd_ {-1};                   // 当前日志段
+  uint64_t segment_lsn_ {0};      // 当前日志段的起始lsn
+  size_t segment_size_ {0};
+  bool unsynced_ {false};
+  bool error_ {false};
+  uint64_t next_lsn_ {1};
+  uint64_t manifest_lsn_ {0};
+  std::string buffer_;            // 没有写入文件的记录
+  std::vector<bool> dirty_;       // 上次checkpoint之后修改过的分区
+  std::vector<std::unordered_set<std::string> > keys_;   // 每个分区的key(序列化后)，可能包含已删除的key
+};
+
+}
+
+#endif
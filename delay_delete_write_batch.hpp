@@ -0,0 +1,64 @@
+#ifndef UTILS_DELAY_DELETE_WRITE_BATCH_HPP_
+#define UTILS_DELAY_DELETE_WRITE_BATCH_HPP_
+
+#include <cstddef>
+#include <vector>
+
+namespace utils {
+
+//一组insert/erase操作，由写线程一次提交。
+//提交后读线程要么看到全部操作之前的状态，要么看到全部操作之后的状态。
+template <class Key, class Value>
+class DelayDeleteWriteBatch {
+ public:
+  enum OpType {
+    kInsert = 0,
+    kErase = 1,
+  };
+  struct Op {
+    int type;
+    size_t index;    // 在values_或keys_中的下标
+  };
+
+  void insert(const Value& obj) {
+    ops_.push_back(Op{kInsert, values_.size()});
+    values_.push_back(obj);
+  }
+  void erase(const Key& key) {
+    ops_.push_back(Op{kErase, keys_.size()});
+    keys_.push_back(key);
+  }
+  void clear() {
+    ops_.clear();
+    values_.clear();
+    keys_.clear();
+  }
+  size_t size() const {
+    return ops_.size();
+  }
+  bool empty() const {
+    return ops_.empty();
+  }
+  size_t insert_count() const {
+    return values_.size();
+  }
+
+  const std::vector<Op>& ops() const {
+    return ops_;
+  }
+  const Value& value(const Op& op) const {
+    return values_[op.index];
+  }
+  const Key& key(const Op& op) const {
+    return keys_[op.index];
+  }
+
+ private:
+  std::vector<Op> ops_;
+  std::vector<Value> values_;
+  std::vector<Key> keys_;
+};
+
+}
+
+#endif
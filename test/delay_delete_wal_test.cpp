@@ -0,0 +1,299 @@
+//DelayDeleteWal的恢复测试
+//  g++ -std=c++11 -pthread -I.. delay_delete_wal_test.cpp -o delay_delete_wal_test && ./delay_delete_wal_test
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "delay_delete_hash_map.hpp"
+
+using namespace utils;
+
+typedef DelayDeleteHashMap<std::string, std::string> Map;
+typedef DelayDeleteMultiHashMap<int64_t, int64_t> MultiMap;
+typedef std::map<std::string, std::string> Expect;
+
+static std::vector<std::string> list_files(const std::string& dir, const std::string& prefix) {
+  std::vector<std::string> files;
+  DIR* d = opendir(dir.c_str());
+  assert(d);
+  for (struct dirent* e = readdir(d); e; e = readdir(d)) {
+    if (0 == strncmp(e->d_name, prefix.c_str(), prefix.size())) {
+      files.push_back(dir + "/" + e->d_name);
+    }
+  }
+  closedir(d);
+  std::sort(files.begin(), files.end());
+  return files;
+}
+
+static std::string read_all(const std::string& path) {
+  std::string data;
+  FILE* f = fopen(path.c_str(), "rb");
+  assert(f);
+  char buf[4096];
+  size_t n = 0;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    data.append(buf, n);
+  }
+  fclose(f);
+  return data;
+}
+
+static void write_all(const std::string& path, const std::string& data) {
+  FILE* f = fopen(path.c_str(), "wb");
+  assert(f);
+  assert(fwrite(data.data(), 1, data.size(), f) == data.size());
+  fclose(f);
+}
+
+static off_t file_size(const std::string& path) {
+  struct stat st;
+  assert(0 == stat(path.c_str(), &st));
+  return st.st_size;
+}
+
+static ino_t file_inode(const std::string& path) {
+  struct stat st;
+  assert(0 == stat(path.c_str(), &st));
+  return st.st_ino;
+}
+
+static void check(Map& m, const Expect& expect) {
+  assert(m.size() == expect.size());
+  for (Expect::const_iterator it = expect.begin(); it != expect.end(); ++it) {
+    Map::iterator found = m.find(it->first);
+    assert(found && found->second == it->second);
+  }
+}
+
+static DelayDeleteWalOptions test_options() {
+  DelayDeleteWalOptions options;
+  options.segment_bytes = 4096;
+  options.group_commit_bytes = 512;
+  options.n_partition = 8;
+  options.sync = false;
+  return options;
+}
+
+static void put(Map& m, Expect& expect, const std::string& k, const std::string& v) {
+  m.insert(std::make_pair(k, v), true, true);
+  expect[k] = v;
+}
+
+//最后一段末尾写了一半的记录被截掉，之前提交的修改都在
+static void test_torn_tail(const std::string& dir) {
+  Expect expect;
+  {
+    Map m;
+    m.init(16);
+    assert(0 == m.enable_wal(dir, test_options()));
+    for (int i = 0; i < 1000; ++i) {
+      put(m, expect, "k" + std::to_string(i), std::to_string(i));
+    }
+    assert(0 == m.checkpoint());
+    for (int i = 0; i < 1000; i += 3) {
+      m.erase("k" + std::to_string(i));
+      expect.erase("k" + std::to_string(i));
+    }
+    assert(0 == m.commit());
+  }
+  std::string last = list_files(dir, "wal.").back();
+  write_all(last, read_all(last) + std::string(17, 'x'));
+  {
+    Map m;
+    m.init(16);
+    assert(0 == m.enable_wal(dir, test_options()));
+    check(m, expect);
+    put(m, expect, "after", "1");
+    assert(0 == m.commit());
+  }
+  Map m;
+  m.init(16);
+  assert(0 == m.enable_wal(dir, test_options()));
+  check(m, expect);
+}
+
+//batch的结束记录没有写入时整个batch被丢弃
+static void test_torn_batch(const std::string& dir) {
+  Expect expect;
+  {
+    Map m;
+    m.init(16);
+    assert(0 == m.enable_wal(dir, test_options()));
+    for (int i = 0; i < 100; ++i) {
+      put(m, expect, "k" + std::to_string(i), std::to_string(i));
+    }
+    Map::write_batch batch;
+    for (int i = 0; i < 100; ++i) {
+      batch.insert(std::make_pair("b" + std::to_string(i), std::string("b")));
+    }
+    batch.erase("k1");
+    assert(0 == m.write(batch));
+    assert(0 == m.commit());
+  }
+  //截掉最后的batch结束记录，它没有key和value
+  std::string last = list_files(dir, "wal.").back();
+  assert(0 == truncate(last.c_str(), file_size(last) - sizeof(WalRecordHeader)));
+  {
+    Map m;
+    m.init(16);
+    assert(0 == m.enable_wal(dir, test_options()));
+    check(m, expect);
+    put(m, expect, "after", "1");
+    assert(0 == m.commit());
+  }
+  Map m;
+  m.init(16);
+  assert(0 == m.enable_wal(dir, test_options()));
+  check(m, expect);
+}
+
+//checkpoint重写了分区但没有写MANIFEST：旧MANIFEST和旧日志段都还在
+static void test_crash_before_manifest(const std::string& dir) {
+  Expect expect;
+  std::string manifest;
+  std::vector<std::pair<std::string, std::string> > segments;
+  {
+    Map m;
+    m.init(16);
+    assert(0 == m.enable_wal(dir, test_options()));
+    for (int i = 0; i < 500; ++i) {
+      put(m, expect, "k" + std::to_string(i), std::to_string(i));
+    }
+    assert(0 == m.checkpoint());
+    for (int i = 0; i < 500; i += 2) {
+      put(m, expect, "k" + std::to_string(i), "v2");
+    }
+    m.erase("k1");
+    expect.erase("k1");
+    assert(0 == m.commit());
+    manifest = read_all(dir + "/MANIFEST");
+    std::vector<std::string> files = list_files(dir, "wal.");
+    for (size_t i = 0; i < files.size(); ++i) {
+      segments.push_back(std::make_pair(files[i], read_all(files[i])));
+    }
+    assert(0 == m.checkpoint());
+  }
+  //回到checkpoint写MANIFEST之前的状态
+  std::vector<std::string> files = list_files(dir, "wal.");
+  for (size_t i = 0; i < files.size(); ++i) {
+    unlink(files[i].c_str());
+  }
+  for (size_t i = 0; i < segments.size(); ++i) {
+    write_all(segments[i].first, segments[i].second);
+  }
+  write_all(dir + "/MANIFEST", manifest);
+  Map m;
+  m.init(16);
+  assert(0 == m.enable_wal(dir, test_options()));
+  check(m, expect);
+}
+
+//clear之后的修改和checkpoint
+static void test_clear(const std::string& dir) {
+  Expect expect;
+  {
+    Map m;
+    m.init(16);
+    assert(0 == m.enable_wal(dir, test_options()));
+    for (int i = 0; i < 300; ++i) {
+      put(m, expect, "k" + std::to_string(i), std::to_string(i));
+    }
+    assert(0 == m.checkpoint());
+    m.clear();
+    expect.clear();
+    put(m, expect, "only", "1");
+    assert(0 == m.commit());
+  }
+  {
+    Map m;
+    m.init(16);
+    assert(0 == m.enable_wal(dir, test_options()));
+    check(m, expect);
+    m.clear();
+    expect.clear();
+    put(m, expect, "k7", "7");
+    assert(0 == m.checkpoint());
+  }
+  Map m;
+  m.init(16);
+  assert(0 == m.enable_wal(dir, test_options()));
+  check(m, expect);
+}
+
+//checkpoint只重写修改过的分区
+static void test_incremental_checkpoint(const std::string& dir) {
+  Expect expect;
+  {
+    Map m;
+    m.init(16);
+    assert(0 == m.enable_wal(dir, test_options()));
+    for (int i = 0; i < 300; ++i) {
+      put(m, expect, "k" + std::to_string(i), std::to_string(i));
+    }
+    assert(0 == m.checkpoint());
+    std::vector<std::string> ckpts = list_files(dir, "ckpt.");
+    assert(8 == ckpts.size());
+    std::vector<ino_t> inodes;
+    for (size_t i = 0; i < ckpts.size(); ++i) {
+      inodes.push_back(file_inode(ckpts[i]));
+    }
+    put(m, expect, "k5", "new");
+    m.erase("k6");
+    expect.erase("k6");
+    assert(0 == m.checkpoint());
+    size_t n_rewrite = 0;
+    for (size_t i = 0; i < ckpts.size(); ++i) {
+      n_rewrite += file_inode(ckpts[i]) != inodes[i];
+    }
+    assert(n_rewrite >= 1 && n_rewrite <= 2);
+  }
+  Map m;
+  m.init(16);
+  assert(0 == m.enable_wal(dir, test_options()));
+  check(m, expect);
+}
+
+//multimap删除某个key的全部元素后，checkpoint不再写出这个key
+static void test_multimap(const std::string& dir) {
+  {
+    MultiMap m;
+    m.init(16);
+    m.insert(std::make_pair(int64_t(1), int64_t(1)));
+    m.insert(std::make_pair(int64_t(1), int64_t(2)));
+    assert(0 == m.enable_wal(dir, test_options()));
+    m.insert(std::make_pair(int64_t(1), int64_t(3)));
+    m.insert(std::make_pair(int64_t(2), int64_t(4)));
+    m.erase(int64_t(1), [](const std::pair<const int64_t, int64_t>& v) { return 2 == v.second; });
+    assert(0 == m.checkpoint());
+    m.erase(int64_t(2));
+    assert(0 == m.checkpoint());
+  }
+  MultiMap m;
+  m.init(16);
+  assert(0 == m.enable_wal(dir, test_options()));
+  assert(2 == m.size());
+  assert(2 == m.count(int64_t(1)));
+  assert(0 == m.count(int64_t(2)));
+}
+
+int main() {
+  char tmpl[] = "/tmp/delay_delete_wal_test.XXXXXX";
+  assert(mkdtemp(tmpl));
+  std::string root = tmpl;
+  test_torn_tail(root + "/torn_tail");
+  test_torn_batch(root + "/torn_batch");
+  test_crash_before_manifest(root + "/manifest");
+  test_clear(root + "/clear");
+  test_incremental_checkpoint(root + "/incremental");
+  test_multimap(root + "/multimap");
+  assert(0 == system(("rm -rf " + root).c_str()));
+  printf("ok\n");
+  return 0;
+}